@@ -1,10 +1,14 @@
+#define _GNU_SOURCE // O_DIRECT
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #include <errno.h>
 #include <fcntl.h>
@@ -12,8 +16,21 @@
 
 #define COLUMN_USERNAME_SIZE 32
 #define COLUMN_EMAIL_SIZE 255
+#define COLUMN_NAME_SIZE 31
+#define COLUMN_TEXT_MAX_SIZE 255
+#define TABLE_NAME_SIZE 31
+#define TABLE_MAX_COLUMNS 8
 #define TABLE_MAX_PAGES 100
-#define size_of_attribute(Struct, Attribute) sizeof(((Struct*)0)->Attribute)
+#define CATALOG_MAX_TABLES 8
+#define DEFAULT_TABLE_NAME "users"
+#define STATEMENT_ARENA_SIZE 65536
+#define SORT_MEMORY_BUDGET (1024 * 1024)
+#define SORT_INITIAL_RUN_ROWS 64
+#define SORT_MAX_RUN_ROWS (1024 * 1024)
+#define SORT_MAX_FAN_IN 64
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define SELECT_MAX_FILTERS 8
+#define BATCH_MAX_ROWS 512 // Enough for a leaf of the narrowest rows
 
 typedef struct 
 {
@@ -34,13 +51,20 @@ typedef enum
     PREPARE_NEGATIVE_ID,
     PREPARE_STRING_TOO_LONG,
     PREPARE_SYNTAX_ERROR,
+    PREPARE_UNKNOWN_TABLE,
+    PREPARE_TABLE_EXISTS,
+    PREPARE_CATALOG_FULL,
+    PREPARE_ROW_TOO_LARGE,
+    PREPARE_KEY_UPDATE,
     PREPARE_FAIL
 } PrepareResult;
 
 typedef enum
 {
     STATEMENT_INSERT,
-    STATEMENT_SELECT
+    STATEMENT_SELECT,
+    STATEMENT_CREATE_TABLE,
+    STATEMENT_UPDATE
 } StatementType;
 
 typedef enum
@@ -53,36 +77,121 @@ typedef enum
 typedef enum
 {
     NODE_INTERNAL,
-    NODE_LEAF
+    NODE_LEAF,
+    NODE_HASH_DIRECTORY,
+    NODE_HASH_BUCKET,
+    NODE_CATALOG,
+    NODE_BLOOM_FILTER
 } NodeType;
 
-typedef struct 
+typedef enum
 {
-    uint32_t id;
-    char username[COLUMN_USERNAME_SIZE + 1];
-    char email[COLUMN_EMAIL_SIZE + 1];
-} Row;
+    COLUMN_INTEGER,
+    COLUMN_TEXT
+} ColumnType;
 
-typedef struct 
+typedef struct
 {
-    StatementType type;
-    Row row_to_insert;
-} Statement;
+    char name[COLUMN_NAME_SIZE + 1];
+    ColumnType type;
+    uint32_t width; // Declared width; text also stores a terminator
+    uint32_t size;
+    uint32_t offset;
+} Column;
+
+// Rows are kept in their serialized layout, computed once per table. The
+// first column is always an integer and serves as the key.
+typedef struct
+{
+    uint32_t num_columns;
+    Column columns[TABLE_MAX_COLUMNS];
+    uint32_t row_size;
+} Schema;
+
+typedef enum
+{
+    FILTER_EQUAL,
+    FILTER_LESS,
+    FILTER_GREATER,
+    FILTER_PREFIX
+} FilterType;
+
+typedef struct
+{
+    uint32_t column_num;
+    FilterType type;
+    uint32_t value; // Integer columns
+    char text[COLUMN_TEXT_MAX_SIZE + 1]; // Text columns, zero-padded
+    uint32_t text_length;
+} Filter;
+
+typedef struct
+{
+    char* base;
+    size_t size;
+    size_t used;
+} Arena;
 
 typedef struct
 {
     int file_desc;
+    bool direct_io; // Bypasses the kernel page cache
     uint32_t file_length;
     uint32_t num_pages;
     void* pages[TABLE_MAX_PAGES];
+    void* frames; // Page-aligned slab with one frame per page number
+    size_t frames_size;
+    bool page_dirty[TABLE_MAX_PAGES]; // Written by the current transaction
+    uint32_t commit_sequence;
+    uint32_t active_header_slot;
+    uint32_t free_pages[TABLE_MAX_PAGES];
+    uint32_t num_free_pages;
+    uint32_t retired_pages[TABLE_MAX_PAGES]; // Still referenced by the older header slot
+    uint32_t num_retired_pages;
+    uint32_t shadowed_pages[TABLE_MAX_PAGES]; // Replaced by the current transaction
+    uint32_t num_shadowed_pages;
 } Pager;
 
 typedef struct 
 {
+    char name[TABLE_NAME_SIZE + 1];
+    Schema schema;
     Pager* pager;
     uint32_t root_page_num;
+    uint32_t hash_directory_page_num; // 0 when there is no hash index
+    uint32_t bloom_filter_page_num;
+    uint32_t rightmost_leaf_page_num; // 0 until looked up
+    Arena* arena;
 } Table;
 
+typedef struct
+{
+    Pager* pager;
+    uint32_t catalog_page_num;
+    Table* tables[CATALOG_MAX_TABLES];
+    uint32_t num_tables;
+    Arena* arena; // Reset after every statement
+    size_t sort_memory_budget;
+} Database;
+
+typedef struct 
+{
+    StatementType type;
+    Table* table;
+    void* row_to_insert; // In the table's serialized layout
+    bool select_by_id;
+    uint32_t select_id;
+    uint32_t last_id; // Scans and updates cover keys select_id through last_id
+    uint32_t num_filters;
+    Filter filters[SELECT_MAX_FILTERS];
+    uint32_t num_assignments;
+    uint32_t assigned_columns[TABLE_MAX_COLUMNS];
+    void* assigned_values; // Row layout; only the assigned columns are set
+    int32_t order_by_column; // -1 for key order
+    char table_name[TABLE_NAME_SIZE + 1]; // Only for create table
+    Schema schema;
+} Statement;
+
 typedef struct 
 {
     Table* table;
@@ -91,15 +200,65 @@ typedef struct
     bool end_of_table; // Indicates a position one past the last element
 } Cursor;
 
-const uint32_t ID_SIZE = size_of_attribute(Row, id);
-const uint32_t USERNAME_SIZE = size_of_attribute(Row, username);
-const uint32_t EMAIL_SIZE = size_of_attribute(Row, email);
-const uint32_t ID_OFFSET = 0;
-const uint32_t USERNAME_OFFSET = ID_OFFSET + ID_SIZE;
-const uint32_t EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
-const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
+// The rows of one leaf, filtered a column at a time. The selection vector
+// lists the rows still passing, in key order.
+typedef struct
+{
+    void* cells;
+    uint32_t cell_size;
+    uint32_t values[BATCH_MAX_ROWS]; // One integer column of the selected rows
+    uint16_t selection[BATCH_MAX_ROWS];
+    uint32_t num_selected;
+} Batch;
+
+typedef void (*RowCallback)(Schema* schema, void* row);
+
+typedef struct
+{
+    uint64_t prefix; // Leading bytes of the sort column, ordered as an integer
+    void* row;
+} SortEntry;
+
+// External merge sort. Rows are sorted in runs that fit the memory budget;
+// once a run fills up it is spilled to a temporary file. Every fan_in runs
+// of the same level are merged into one run of the next level, so only a
+// few run files are open at once.
+typedef struct
+{
+    Schema* schema;
+    Column* column;
+    bool prefix_is_exact; // Whether equal prefixes mean equal column values
+    uint32_t run_capacity; // Rows a run may hold under the budget
+    uint32_t allocated_rows; // Rows the buffers currently hold
+    uint32_t fan_in;
+    void* rows;
+    SortEntry* entries;
+    SortEntry* scratch;
+    uint32_t num_rows;
+    FILE** runs;
+    uint32_t* run_levels;
+    uint32_t num_runs;
+} Sorter;
+
 const uint32_t PAGE_SIZE = 4096;
 
+// File header layout
+// Page 0 holds two header slots. A commit writes the slot that is not
+// active, so a torn header write always leaves the previous one intact.
+
+const uint32_t HEADER_PAGE_NUM = 0;
+const uint32_t HEADER_MAGIC = 0x31424453; // "SDB1"
+const uint32_t HEADER_NUM_SLOTS = 2;
+const uint32_t HEADER_SLOT_SPACING = PAGE_SIZE / 2;
+const uint32_t HEADER_SLOT_MAGIC_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_SLOT_MAGIC_OFFSET = 0;
+const uint32_t HEADER_SLOT_SEQUENCE_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_SLOT_SEQUENCE_OFFSET = HEADER_SLOT_MAGIC_OFFSET + HEADER_SLOT_MAGIC_SIZE;
+const uint32_t HEADER_SLOT_CATALOG_PAGE_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_SLOT_CATALOG_PAGE_OFFSET = HEADER_SLOT_SEQUENCE_OFFSET + HEADER_SLOT_SEQUENCE_SIZE;
+const uint32_t HEADER_SLOT_CHECKSUM_SIZE = sizeof(uint32_t);
+const uint32_t HEADER_SLOT_CHECKSUM_OFFSET = HEADER_SLOT_CATALOG_PAGE_OFFSET + HEADER_SLOT_CATALOG_PAGE_SIZE;
+
 // Node header layout
 
 const uint32_t NODE_TYPE_SIZE = sizeof(uint8_t);
@@ -114,20 +273,19 @@ const uint8_t COMMON_NODE_HEADER_SIZE = NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_P
 
 const uint32_t LEAF_NODE_NUM_CELLS_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE;
+const uint32_t LEAF_NODE_CELL_SIZE_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_CELL_SIZE_OFFSET = LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
+const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_CELL_SIZE_SIZE;
 
 // Leaf node body layout
+// Cells are a key followed by a row of the owning table's schema, so the
+// cell size is recorded in each leaf.
 
 const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_KEY_OFFSET = 0;
-const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE;
 const uint32_t LEAF_NODE_VALUE_OFFSET = LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
-const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
 const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_MAX_CELLS = LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
-
-const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2;
-const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;
+const uint32_t LEAF_NODE_MIN_CELLS = 3; // A split must leave cells on both sides
 
 // Internal node header layout
 
@@ -142,6 +300,71 @@ const uint32_t INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + INTERNAL_NO
 const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_CELL_SIZE = INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
+const uint32_t INTERNAL_NODE_MAX_CELLS = (PAGE_SIZE - INTERNAL_NODE_HEADER_SIZE) / INTERNAL_NODE_CELL_SIZE;
+
+// Pre-header file layout
+// Files from before the header page hold only the users tree, rooted at
+// page 0. Leaves have no cell size field; internal nodes and rows are laid
+// out as they are now.
+
+const uint32_t PRE_HEADER_LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE;
+
+// Hash directory layout
+
+const uint32_t HASH_DIRECTORY_GLOBAL_DEPTH_SIZE = sizeof(uint32_t);
+const uint32_t HASH_DIRECTORY_GLOBAL_DEPTH_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t HASH_DIRECTORY_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + HASH_DIRECTORY_GLOBAL_DEPTH_SIZE;
+const uint32_t HASH_DIRECTORY_ENTRY_SIZE = sizeof(uint32_t);
+const uint32_t HASH_DIRECTORY_MAX_GLOBAL_DEPTH = 9; // 512 entries fit in one page
+
+// Hash bucket layout
+// Cells use the leaf cell format, so a lookup ends at the row itself.
+
+const uint32_t HASH_BUCKET_LOCAL_DEPTH_SIZE = sizeof(uint32_t);
+const uint32_t HASH_BUCKET_LOCAL_DEPTH_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t HASH_BUCKET_NUM_CELLS_SIZE = sizeof(uint32_t);
+const uint32_t HASH_BUCKET_NUM_CELLS_OFFSET = HASH_BUCKET_LOCAL_DEPTH_OFFSET + HASH_BUCKET_LOCAL_DEPTH_SIZE;
+const uint32_t HASH_BUCKET_CELL_SIZE_SIZE = sizeof(uint32_t);
+const uint32_t HASH_BUCKET_CELL_SIZE_OFFSET = HASH_BUCKET_NUM_CELLS_OFFSET + HASH_BUCKET_NUM_CELLS_SIZE;
+const uint32_t HASH_BUCKET_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + HASH_BUCKET_LOCAL_DEPTH_SIZE + HASH_BUCKET_NUM_CELLS_SIZE + HASH_BUCKET_CELL_SIZE_SIZE;
+
+// Bloom filter layout
+// One page of bits per table over the primary key. It is updated in place
+// rather than shadowed, so it records the commit that last wrote it.
+
+const uint32_t BLOOM_FILTER_SEQUENCE_SIZE = sizeof(uint32_t);
+const uint32_t BLOOM_FILTER_SEQUENCE_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t BLOOM_FILTER_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + BLOOM_FILTER_SEQUENCE_SIZE;
+const uint32_t BLOOM_FILTER_NUM_BITS = (PAGE_SIZE - BLOOM_FILTER_HEADER_SIZE) * 8;
+const uint32_t BLOOM_FILTER_NUM_HASHES = 3;
+
+// Catalog layout
+// One page lists every table with its root pages and column definitions.
+
+const uint32_t CATALOG_NUM_TABLES_SIZE = sizeof(uint32_t);
+const uint32_t CATALOG_NUM_TABLES_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t CATALOG_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + CATALOG_NUM_TABLES_SIZE;
+
+const uint32_t CATALOG_COLUMN_NAME_SIZE = COLUMN_NAME_SIZE + 1;
+const uint32_t CATALOG_COLUMN_NAME_OFFSET = 0;
+const uint32_t CATALOG_COLUMN_TYPE_SIZE = sizeof(uint32_t);
+const uint32_t CATALOG_COLUMN_TYPE_OFFSET = CATALOG_COLUMN_NAME_OFFSET + CATALOG_COLUMN_NAME_SIZE;
+const uint32_t CATALOG_COLUMN_WIDTH_SIZE = sizeof(uint32_t);
+const uint32_t CATALOG_COLUMN_WIDTH_OFFSET = CATALOG_COLUMN_TYPE_OFFSET + CATALOG_COLUMN_TYPE_SIZE;
+const uint32_t CATALOG_COLUMN_SIZE = CATALOG_COLUMN_NAME_SIZE + CATALOG_COLUMN_TYPE_SIZE + CATALOG_COLUMN_WIDTH_SIZE;
+
+const uint32_t CATALOG_ENTRY_NAME_SIZE = TABLE_NAME_SIZE + 1;
+const uint32_t CATALOG_ENTRY_NAME_OFFSET = 0;
+const uint32_t CATALOG_ENTRY_ROOT_PAGE_SIZE = sizeof(uint32_t);
+const uint32_t CATALOG_ENTRY_ROOT_PAGE_OFFSET = CATALOG_ENTRY_NAME_OFFSET + CATALOG_ENTRY_NAME_SIZE;
+const uint32_t CATALOG_ENTRY_HASH_DIRECTORY_SIZE = sizeof(uint32_t);
+const uint32_t CATALOG_ENTRY_HASH_DIRECTORY_OFFSET = CATALOG_ENTRY_ROOT_PAGE_OFFSET + CATALOG_ENTRY_ROOT_PAGE_SIZE;
+const uint32_t CATALOG_ENTRY_NUM_COLUMNS_SIZE = sizeof(uint32_t);
+const uint32_t CATALOG_ENTRY_BLOOM_FILTER_SIZE = sizeof(uint32_t);
+const uint32_t CATALOG_ENTRY_BLOOM_FILTER_OFFSET = CATALOG_ENTRY_HASH_DIRECTORY_OFFSET + CATALOG_ENTRY_HASH_DIRECTORY_SIZE;
+const uint32_t CATALOG_ENTRY_NUM_COLUMNS_OFFSET = CATALOG_ENTRY_BLOOM_FILTER_OFFSET + CATALOG_ENTRY_BLOOM_FILTER_SIZE;
+const uint32_t CATALOG_ENTRY_COLUMNS_OFFSET = CATALOG_ENTRY_NUM_COLUMNS_OFFSET + CATALOG_ENTRY_NUM_COLUMNS_SIZE;
+const uint32_t CATALOG_ENTRY_SIZE = CATALOG_ENTRY_COLUMNS_OFFSET + TABLE_MAX_COLUMNS * CATALOG_COLUMN_SIZE;
 
 NodeType get_node_type(void* node)
 {
@@ -160,9 +383,19 @@ uint32_t* leaf_node_num_cells(void* node)
     return node + LEAF_NODE_NUM_CELLS_OFFSET;
 }
 
+uint32_t* leaf_node_cell_size(void* node)
+{
+    return node + LEAF_NODE_CELL_SIZE_OFFSET;
+}
+
+uint32_t leaf_node_max_cells(void* node)
+{
+    return LEAF_NODE_SPACE_FOR_CELLS / *leaf_node_cell_size(node);
+}
+
 void* leaf_node_cell(void* node, uint32_t cell_num)
 {
-    return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
+    return node + LEAF_NODE_HEADER_SIZE + cell_num * *leaf_node_cell_size(node);
 }
 
 uint32_t* leaf_node_key(void* node, uint32_t cell_num)
@@ -175,17 +408,194 @@ void* leaf_node_value(void* node, uint32_t cell_num)
     return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
 }
 
+bool is_node_root(void* node)
+{
+    uint8_t value = *((uint8_t*)(node + IS_ROOT_OFFSET));
+    return (bool)value;
+}
+
 void set_node_root(void* node, bool is_root)
 {
     uint8_t value = is_root;
     *((uint8_t*)(node + IS_ROOT_OFFSET)) = value;
 }
 
-void initialize_leaf_node(void* node)
+uint32_t* internal_node_cell(void* node, uint32_t cell_num)
+{
+    return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
+}
+
+uint32_t* internal_node_key(void* node, uint32_t key_num)
+{
+    return (void*)internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+}
+
+uint32_t* internal_node_num_keys(void* node)
+{
+    return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
+}
+
+uint32_t* internal_node_right_child(void* node)
+{
+    return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
+}
+
+uint32_t* internal_node_child(void* node, uint32_t child_num)
+{
+    uint32_t num_keys = *internal_node_num_keys(node);
+    if (child_num > num_keys)
+    {
+        printf("Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
+        exit(EXIT_FAILURE);
+    }
+    else if (child_num == num_keys)
+    {
+        return internal_node_right_child(node);
+    }
+    else
+    {
+        return internal_node_cell(node, child_num);
+    }
+}
+
+uint32_t* hash_directory_global_depth(void* node)
+{
+    return node + HASH_DIRECTORY_GLOBAL_DEPTH_OFFSET;
+}
+
+uint32_t* hash_directory_entry(void* node, uint32_t entry_num)
+{
+    return node + HASH_DIRECTORY_HEADER_SIZE + entry_num * HASH_DIRECTORY_ENTRY_SIZE;
+}
+
+uint32_t* hash_bucket_local_depth(void* node)
+{
+    return node + HASH_BUCKET_LOCAL_DEPTH_OFFSET;
+}
+
+uint32_t* hash_bucket_num_cells(void* node)
+{
+    return node + HASH_BUCKET_NUM_CELLS_OFFSET;
+}
+
+uint32_t* hash_bucket_cell_size(void* node)
+{
+    return node + HASH_BUCKET_CELL_SIZE_OFFSET;
+}
+
+uint32_t hash_bucket_max_cells(void* node)
+{
+    return (PAGE_SIZE - HASH_BUCKET_HEADER_SIZE) / *hash_bucket_cell_size(node);
+}
+
+void* hash_bucket_cell(void* node, uint32_t cell_num)
+{
+    return node + HASH_BUCKET_HEADER_SIZE + cell_num * *hash_bucket_cell_size(node);
+}
+
+uint32_t* catalog_num_tables(void* node)
+{
+    return node + CATALOG_NUM_TABLES_OFFSET;
+}
+
+void* catalog_entry(void* node, uint32_t table_num)
+{
+    return node + CATALOG_HEADER_SIZE + table_num * CATALOG_ENTRY_SIZE;
+}
+
+char* catalog_entry_name(void* entry)
+{
+    return entry + CATALOG_ENTRY_NAME_OFFSET;
+}
+
+uint32_t* catalog_entry_root_page(void* entry)
+{
+    return entry + CATALOG_ENTRY_ROOT_PAGE_OFFSET;
+}
+
+uint32_t* catalog_entry_hash_directory(void* entry)
+{
+    return entry + CATALOG_ENTRY_HASH_DIRECTORY_OFFSET;
+}
+
+uint32_t* catalog_entry_bloom_filter(void* entry)
+{
+    return entry + CATALOG_ENTRY_BLOOM_FILTER_OFFSET;
+}
+
+uint32_t* catalog_entry_num_columns(void* entry)
+{
+    return entry + CATALOG_ENTRY_NUM_COLUMNS_OFFSET;
+}
+
+void* catalog_entry_column(void* entry, uint32_t column_num)
+{
+    return entry + CATALOG_ENTRY_COLUMNS_OFFSET + column_num * CATALOG_COLUMN_SIZE;
+}
+
+char* catalog_column_name(void* column)
+{
+    return column + CATALOG_COLUMN_NAME_OFFSET;
+}
+
+uint32_t* catalog_column_type(void* column)
+{
+    return column + CATALOG_COLUMN_TYPE_OFFSET;
+}
+
+uint32_t* catalog_column_width(void* column)
+{
+    return column + CATALOG_COLUMN_WIDTH_OFFSET;
+}
+
+uint32_t* bloom_filter_sequence(void* node)
+{
+    return node + BLOOM_FILTER_SEQUENCE_OFFSET;
+}
+
+uint8_t* bloom_filter_bits(void* node)
+{
+    return node + BLOOM_FILTER_HEADER_SIZE;
+}
+
+void initialize_leaf_node(void* node, uint32_t cell_size)
 {
     set_node_type(node, NODE_LEAF);
     set_node_root(node, false);
     *leaf_node_num_cells(node) = 0;
+    *leaf_node_cell_size(node) = cell_size;
+}
+
+Arena* new_arena(size_t size)
+{
+    Arena* arena = malloc(sizeof(Arena));
+    arena->base = malloc(size);
+    arena->size = size;
+    arena->used = 0;
+    return arena;
+}
+
+void* arena_alloc(Arena* arena, size_t size)
+{
+    size_t start = (arena->used + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+    if (start + size > arena->size)
+    {
+        printf("Error: Statement arena exhausted. %zu > %zu\n", start + size, arena->size);
+        exit(EXIT_FAILURE);
+    }
+    arena->used = start + size;
+    return arena->base + start;
+}
+
+void arena_reset(Arena* arena)
+{
+    arena->used = 0;
+}
+
+void free_arena(Arena* arena)
+{
+    free(arena->base);
+    free(arena);
 }
 
 InputBuffer* new_input_buffer()
@@ -198,9 +608,22 @@ InputBuffer* new_input_buffer()
     return input_buf;
 }
 
-Pager* pager_open(const char* filename)
+Pager* pager_open(const char* filename, bool direct_io)
 {
-    int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+    int fd = -1;
+    if (direct_io)
+    {
+        fd = open(filename, O_RDWR | O_CREAT | O_DIRECT, S_IWUSR | S_IRUSR);
+        if (fd == -1 && errno == EINVAL)
+        {
+            // The filesystem does not support O_DIRECT (tmpfs, for one).
+            direct_io = false;
+        }
+    }
+    if (!direct_io)
+    {
+        fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+    }
     if (fd == -1)
     {
         printf("Error: unable to open file");
@@ -209,24 +632,61 @@ Pager* pager_open(const char* filename)
     
     off_t file_length = lseek(fd, 0, SEEK_END);
 
+    // A partial page at the end is left out of num_pages. db_open drops it
+    // once the header shows the file is a database.
     Pager* pager = malloc(sizeof(Pager));
     pager->file_desc = fd;
+    pager->direct_io = direct_io;
     pager->file_length = file_length;
     pager->num_pages = (file_length / PAGE_SIZE);
 
-    if (file_length % PAGE_SIZE != 0)
+    // Reserve every frame up front. Huge pages keep the whole cache under
+    // one TLB entry; fall back to normal pages when none are configured.
+    pager->frames_size = (TABLE_MAX_PAGES * PAGE_SIZE + HUGE_PAGE_SIZE - 1) & ~((size_t)HUGE_PAGE_SIZE - 1);
+    pager->frames = mmap(NULL, pager->frames_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (pager->frames == MAP_FAILED)
     {
-        printf("Error: Corrupt file. Db file is not a whole number of pages.\n");
+        pager->frames_size = TABLE_MAX_PAGES * PAGE_SIZE;
+        pager->frames = mmap(NULL, pager->frames_size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (pager->frames == MAP_FAILED)
+    {
+        printf("Error: Unable to allocate page frames %d\n", errno);
         exit(EXIT_FAILURE);
     }
 
     for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++)
     {
         pager->pages[i] = NULL;
+        pager->page_dirty[i] = false;
     }
+    pager->commit_sequence = 0;
+    pager->active_header_slot = HEADER_NUM_SLOTS - 1;
+    pager->num_free_pages = 0;
+    pager->num_retired_pages = 0;
+    pager->num_shadowed_pages = 0;
     return pager;
 }
 
+// Some filesystems accept O_DIRECT at open time and only reject the I/O.
+bool pager_fall_back_to_buffered_io(Pager* pager)
+{
+    if (!pager->direct_io || errno != EINVAL)
+    {
+        return false;
+    }
+
+    int flags = fcntl(pager->file_desc, F_GETFL);
+    if (flags == -1 || fcntl(pager->file_desc, F_SETFL, flags & ~O_DIRECT) == -1)
+    {
+        return false;
+    }
+    pager->direct_io = false;
+    return true;
+}
+
 void pager_flush(Pager* pager, uint32_t page_num)
 {
     if (pager->pages[page_num] == NULL)
@@ -234,15 +694,15 @@ void pager_flush(Pager* pager, uint32_t page_num)
         printf("Error: Tried to flush null page\n");
         exit(EXIT_FAILURE);
     }
-    
-    off_t offset = lseek(pager->file_desc, page_num * PAGE_SIZE, SEEK_SET);
-    if (offset == -1)
+
+    // Frames are page-aligned and every transfer is one whole page at a page
+    // offset, which is what O_DIRECT requires.
+    off_t offset = (off_t)page_num * PAGE_SIZE;
+    ssize_t byte_written = pwrite(pager->file_desc, pager->pages[page_num], PAGE_SIZE, offset);
+    if (byte_written == -1 && pager_fall_back_to_buffered_io(pager))
     {
-        printf("Error: Seeking %d", errno);
-        exit(EXIT_FAILURE);
+        byte_written = pwrite(pager->file_desc, pager->pages[page_num], PAGE_SIZE, offset);
     }
-
-    ssize_t byte_written = write(pager->file_desc, pager->pages[page_num], PAGE_SIZE);
     if (byte_written == -1)
     {
         printf("Error: Writing %d", errno);
@@ -250,9 +710,14 @@ void pager_flush(Pager* pager, uint32_t page_num)
     }
 }
 
+void* pager_frame(Pager* pager, uint32_t page_num)
+{
+    return pager->frames + page_num * PAGE_SIZE;
+}
+
 void* get_page(Pager* pager, uint32_t page_num)
 {
-    if (page_num > TABLE_MAX_PAGES)
+    if (page_num >= TABLE_MAX_PAGES)
     {
         printf("Error: Tried to fetch page number out of bounds. %d > %d",page_num, TABLE_MAX_PAGES);
         exit(EXIT_FAILURE);
@@ -260,8 +725,8 @@ void* get_page(Pager* pager, uint32_t page_num)
 
     if (pager->pages[page_num] == NULL)
     {
-        // Cache miss. Allocate memory and load from file.
-        void* page = malloc(PAGE_SIZE);
+        // Cache miss. Take the page's frame from the slab and load from file.
+        void* page = pager_frame(pager, page_num);
         uint32_t num_pages = pager->file_length / PAGE_SIZE;
 
         // Case where saving partial page at the end of file.
@@ -272,8 +737,12 @@ void* get_page(Pager* pager, uint32_t page_num)
 
         if (page_num <= num_pages)
         {
-            lseek(pager->file_desc, page_num * PAGE_SIZE, SEEK_SET);
-            ssize_t bytes_read = read(pager->file_desc, page, PAGE_SIZE);
+            off_t offset = (off_t)page_num * PAGE_SIZE;
+            ssize_t bytes_read = pread(pager->file_desc, page, PAGE_SIZE, offset);
+            if (bytes_read == -1 && pager_fall_back_to_buffered_io(pager))
+            {
+                bytes_read = pread(pager->file_desc, page, PAGE_SIZE, offset);
+            }
             if (bytes_read == -1)
             {
                 printf("Error: Fail to read file '%d'\n", errno);
@@ -290,134 +759,566 @@ void* get_page(Pager* pager, uint32_t page_num)
     return pager->pages[page_num];
 }
 
-Table* db_open(const char* filename)
+uint32_t pager_num_unused_pages(Pager* pager)
 {
-    Pager* pager = pager_open(filename);
+    return pager->num_free_pages + (TABLE_MAX_PAGES - pager->num_pages);
+}
 
-    Table* table = malloc(sizeof(Table));
-    table->pager = pager;
-    table->root_page_num = 0;
+uint32_t get_unused_page_num(Pager* pager)
+{
+    uint32_t page_num;
+    if (pager->num_free_pages > 0)
+    {
+        page_num = pager->free_pages[--pager->num_free_pages];
+    }
+    else
+    {
+        page_num = pager->num_pages;
+    }
 
-    if (pager->num_pages == 0)
+    if (page_num >= TABLE_MAX_PAGES)
     {
-        void* root_node = get_page(pager, 0);
-        initialize_leaf_node(root_node);
-        set_node_root(root_node, true);
+        printf("Error: Tried to allocate page number out of bounds. %d >= %d\n", page_num, TABLE_MAX_PAGES);
+        exit(EXIT_FAILURE);
     }
 
-    return table;
+    // A fresh page is owned by the current transaction, so there is nothing
+    // worth reading from disk.
+    if (pager->pages[page_num] == NULL)
+    {
+        pager->pages[page_num] = pager_frame(pager, page_num);
+    }
+    if (page_num >= pager->num_pages)
+    {
+        pager->num_pages = page_num + 1;
+    }
+    pager->page_dirty[page_num] = true;
+    return page_num;
 }
 
-void db_close(Table *table)
+// Returns a page number holding a writable copy of page_num. Pages from the
+// last commit are never modified in place; they are copied to a fresh page
+// and released once no header slot refers to them any more.
+uint32_t pager_shadow_page(Pager* pager, uint32_t page_num)
 {
-    Pager* pager = table->pager;
-
-    for (uint32_t i = 0; i < pager->num_pages; i++)
+    if (pager->page_dirty[page_num])
     {
-        if (pager->pages[i] == NULL)
-        {
-            continue;
-        }
-        pager_flush(pager, i);
-        free(pager->pages[i]);
-        pager->pages[i] = NULL;
+        return page_num;
     }
 
-    int result = close(pager->file_desc);
-    if (result == -1)
+    void* page = get_page(pager, page_num);
+    uint32_t new_page_num = get_unused_page_num(pager);
+    memcpy(get_page(pager, new_page_num), page, PAGE_SIZE);
+
+    pager->shadowed_pages[pager->num_shadowed_pages++] = page_num;
+    return new_page_num;
+}
+
+void pager_sync(Pager* pager)
+{
+    if (fsync(pager->file_desc) == -1)
     {
-        printf("Error: Fail to close db file.\n");
+        printf("Error: Syncing %d", errno);
         exit(EXIT_FAILURE);
     }
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++)
-    {
-        void* page = pager->pages[i];
-        if (page)
-        {
-            free(page);
-            pager->pages[i] = NULL;
-        }
-    }
-    free(pager);
-    free(table);
 }
 
-void print_prompt()
+void* header_slot(void* header, uint32_t slot_num)
 {
-    printf("db > ");
+    return header + slot_num * HEADER_SLOT_SPACING;
 }
 
-void print_row(Row* row)
+uint32_t* header_slot_magic(void* slot)
 {
-    printf("(%d, %s, %s)\n", row->id, row->username, row->email);
+    return slot + HEADER_SLOT_MAGIC_OFFSET;
 }
 
-void read_input(InputBuffer* input_buf)
+uint32_t* header_slot_sequence(void* slot)
 {
-    ssize_t bytes_read = getline(&(input_buf->buffer), &input_buf->buffer_length, stdin);
-    if (bytes_read <= 0)
-    {
-        printf("Error: Reading input failed");
-        exit(EXIT_FAILURE);
-    }
-    input_buf->input_length = bytes_read - 1;
-    input_buf->buffer[bytes_read - 1] = 0;
+    return slot + HEADER_SLOT_SEQUENCE_OFFSET;
 }
 
-void close_input_buffer(InputBuffer* input_buf)
+uint32_t* header_slot_catalog_page(void* slot)
 {
-    free(input_buf->buffer);
-    free(input_buf);
+    return slot + HEADER_SLOT_CATALOG_PAGE_OFFSET;
 }
 
-void indent(uint32_t level) 
+uint32_t* header_slot_checksum(void* slot)
 {
-    for (uint32_t i = 0; i < level; i++)    
+    return slot + HEADER_SLOT_CHECKSUM_OFFSET;
+}
+
+uint32_t header_slot_compute_checksum(void* slot)
+{
+    // FNV-1a over every field before the checksum.
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < HEADER_SLOT_CHECKSUM_OFFSET; i++)
     {
-        printf("  ");
+        hash ^= *((uint8_t*)(slot + i));
+        hash *= 16777619u;
     }
+    return hash;
 }
 
-uint32_t* internal_node_cell(void* node, uint32_t cell_num)
+bool header_slot_is_valid(void* slot)
 {
-    return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
+    return *header_slot_magic(slot) == HEADER_MAGIC &&
+           *header_slot_checksum(slot) == header_slot_compute_checksum(slot);
 }
 
-uint32_t* internal_node_key(void* node, uint32_t key_num)
+void header_slot_write(void* slot, uint32_t sequence, uint32_t catalog_page_num)
 {
-    return internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+    *header_slot_magic(slot) = HEADER_MAGIC;
+    *header_slot_sequence(slot) = sequence;
+    *header_slot_catalog_page(slot) = catalog_page_num;
+    *header_slot_checksum(slot) = header_slot_compute_checksum(slot);
 }
 
-uint32_t get_unused_page_num(Pager* pager)
+uint32_t hash_key(uint32_t key)
 {
-    return pager->num_pages;
+    // MurmurHash3 finalizer, so sequential ids spread over every bucket.
+    key ^= key >> 16;
+    key *= 0x85ebca6b;
+    key ^= key >> 13;
+    key *= 0xc2b2ae35;
+    key ^= key >> 16;
+    return key;
 }
 
-uint32_t* internal_node_num_keys(void* node)
+void initialize_bloom_filter(void* node)
 {
-    return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
+    memset(node, 0, PAGE_SIZE);
+    set_node_type(node, NODE_BLOOM_FILTER);
 }
 
-uint32_t* internal_node_right_child(void* node)
+// Double hashing: the bit positions are h1 + i * h2 for each hash i.
+void bloom_filter_add(void* node, uint32_t key)
 {
-    return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
+    uint32_t h1 = hash_key(key);
+    uint32_t h2 = hash_key(h1) | 1;
+    uint8_t* bits = bloom_filter_bits(node);
+    for (uint32_t i = 0; i < BLOOM_FILTER_NUM_HASHES; i++)
+    {
+        uint32_t bit = (h1 + i * h2) % BLOOM_FILTER_NUM_BITS;
+        bits[bit / 8] |= 1 << (bit % 8);
+    }
 }
 
-uint32_t* internal_node_child(void* node, uint32_t child_num)
+bool bloom_filter_might_contain(void* node, uint32_t key)
 {
-    uint32_t num_keys = *internal_node_num_keys(node);
-    if (child_num > num_keys)
+    uint32_t h1 = hash_key(key);
+    uint32_t h2 = hash_key(h1) | 1;
+    uint8_t* bits = bloom_filter_bits(node);
+    for (uint32_t i = 0; i < BLOOM_FILTER_NUM_HASHES; i++)
     {
-        printf("Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
+        uint32_t bit = (h1 + i * h2) % BLOOM_FILTER_NUM_BITS;
+        if (!(bits[bit / 8] & (1 << (bit % 8))))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void bloom_filter_add_tree(Pager* pager, uint32_t page_num, void* filter)
+{
+    void* node = get_page(pager, page_num);
+    if (get_node_type(node) == NODE_INTERNAL)
+    {
+        uint32_t num_keys = *internal_node_num_keys(node);
+        for (uint32_t i = 0; i <= num_keys; i++)
+        {
+            bloom_filter_add_tree(pager, *internal_node_child(node, i), filter);
+        }
+        return;
+    }
+
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    for (uint32_t i = 0; i < num_cells; i++)
+    {
+        bloom_filter_add(filter, *leaf_node_key(node, i));
+    }
+}
+
+void mark_reachable_pages(Pager* pager, uint32_t page_num, bool* reachable)
+{
+    reachable[page_num] = true;
+
+    void* node = get_page(pager, page_num);
+    uint32_t num_keys, num_entries, num_tables;
+    switch (get_node_type(node))
+    {
+        case (NODE_INTERNAL):
+            num_keys = *internal_node_num_keys(node);
+            for (uint32_t i = 0; i <= num_keys; i++)
+            {
+                mark_reachable_pages(pager, *internal_node_child(node, i), reachable);
+            }
+            break;
+
+        case (NODE_HASH_DIRECTORY):
+            num_entries = 1u << *hash_directory_global_depth(node);
+            for (uint32_t i = 0; i < num_entries; i++)
+            {
+                reachable[*hash_directory_entry(node, i)] = true;
+            }
+            break;
+
+        case (NODE_CATALOG):
+            num_tables = *catalog_num_tables(node);
+            for (uint32_t i = 0; i < num_tables; i++)
+            {
+                void* entry = catalog_entry(node, i);
+                mark_reachable_pages(pager, *catalog_entry_root_page(entry), reachable);
+                reachable[*catalog_entry_bloom_filter(entry)] = true;
+                if (*catalog_entry_hash_directory(entry) != 0)
+                {
+                    mark_reachable_pages(pager, *catalog_entry_hash_directory(entry), reachable);
+                }
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+// Pages that no header slot can reach are left over from transactions that
+// were shadowed, or from a crash before the header was written. Pages only
+// the inactive slot reaches are retired, so the next commit, which
+// overwrites that slot, frees them.
+void pager_reclaim_unreachable_pages(Pager* pager)
+{
+    bool reachable_from_active[TABLE_MAX_PAGES] = { false };
+    bool reachable_from_inactive[TABLE_MAX_PAGES] = { false };
+    reachable_from_active[HEADER_PAGE_NUM] = true;
+
+    void* header = get_page(pager, HEADER_PAGE_NUM);
+    for (uint32_t i = 0; i < HEADER_NUM_SLOTS; i++)
+    {
+        void* slot = header_slot(header, i);
+        if (header_slot_is_valid(slot) && *header_slot_catalog_page(slot) != HEADER_PAGE_NUM)
+        {
+            bool* reachable = (i == pager->active_header_slot) ? reachable_from_active : reachable_from_inactive;
+            mark_reachable_pages(pager, *header_slot_catalog_page(slot), reachable);
+        }
+    }
+
+    for (uint32_t i = pager->num_pages; i > 0; i--)
+    {
+        if (reachable_from_active[i - 1])
+        {
+            continue;
+        }
+        if (reachable_from_inactive[i - 1])
+        {
+            pager->retired_pages[pager->num_retired_pages++] = i - 1;
+        }
+        else
+        {
+            pager->free_pages[pager->num_free_pages++] = i - 1;
+        }
+    }
+}
+
+// Lays out the columns back to back. This runs once when a table is created
+// or loaded, so rows are exactly as wide as the columns they declare.
+void schema_compute_layout(Schema* schema)
+{
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < schema->num_columns; i++)
+    {
+        Column* column = &schema->columns[i];
+        switch (column->type)
+        {
+            case (COLUMN_INTEGER):
+                column->size = sizeof(uint32_t);
+                break;
+
+            case (COLUMN_TEXT):
+                column->size = column->width + 1;
+                break;
+        }
+        column->offset = offset;
+        offset += column->size;
+    }
+    schema->row_size = offset;
+}
+
+int32_t schema_find_column(Schema* schema, const char* name)
+{
+    for (uint32_t i = 0; i < schema->num_columns; i++)
+    {
+        if (strcmp(schema->columns[i].name, name) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+Table* db_add_table(Database* db, const char* name, Schema* schema)
+{
+    Table* table = malloc(sizeof(Table));
+    strcpy(table->name, name);
+    table->schema = *schema;
+    schema_compute_layout(&table->schema);
+    table->pager = db->pager;
+    table->arena = db->arena;
+    table->root_page_num = 0;
+    table->hash_directory_page_num = 0;
+    table->rightmost_leaf_page_num = 0;
+
+    db->tables[db->num_tables++] = table;
+    return table;
+}
+
+Table* db_find_table(Database* db, const char* name)
+{
+    for (uint32_t i = 0; i < db->num_tables; i++)
+    {
+        if (strcmp(db->tables[i]->name, name) == 0)
+        {
+            return db->tables[i];
+        }
+    }
+    return NULL;
+}
+
+Table* db_create_table(Database* db, const char* name, Schema* schema)
+{
+    Table* table = db_add_table(db, name, schema);
+    table->root_page_num = get_unused_page_num(db->pager);
+    void* root_node = get_page(db->pager, table->root_page_num);
+    initialize_leaf_node(root_node, LEAF_NODE_KEY_SIZE + table->schema.row_size);
+    set_node_root(root_node, true);
+
+    table->bloom_filter_page_num = get_unused_page_num(db->pager);
+    initialize_bloom_filter(get_page(db->pager, table->bloom_filter_page_num));
+    return table;
+}
+
+void catalog_read(Database* db, void* node)
+{
+    uint32_t num_tables = *catalog_num_tables(node);
+    for (uint32_t i = 0; i < num_tables; i++)
+    {
+        void* entry = catalog_entry(node, i);
+        Schema schema;
+        schema.num_columns = *catalog_entry_num_columns(entry);
+        for (uint32_t j = 0; j < schema.num_columns; j++)
+        {
+            void* column = catalog_entry_column(entry, j);
+            strcpy(schema.columns[j].name, catalog_column_name(column));
+            schema.columns[j].type = *catalog_column_type(column);
+            schema.columns[j].width = *catalog_column_width(column);
+        }
+
+        Table* table = db_add_table(db, catalog_entry_name(entry), &schema);
+        table->root_page_num = *catalog_entry_root_page(entry);
+        table->hash_directory_page_num = *catalog_entry_hash_directory(entry);
+        table->bloom_filter_page_num = *catalog_entry_bloom_filter(entry);
+
+        // A filter written ahead of a commit that never reached the header
+        // may hold keys the tree does not. Those only cost false positives,
+        // but the filter is rebuilt from the tree to drop them.
+        void* filter = get_page(db->pager, table->bloom_filter_page_num);
+        if (*bloom_filter_sequence(filter) > db->pager->commit_sequence)
+        {
+            initialize_bloom_filter(filter);
+            bloom_filter_add_tree(db->pager, table->root_page_num, filter);
+            db->pager->page_dirty[table->bloom_filter_page_num] = true;
+        }
+    }
+}
+
+void catalog_write(Database* db, void* node)
+{
+    memset(node, 0, PAGE_SIZE);
+    set_node_type(node, NODE_CATALOG);
+    *catalog_num_tables(node) = db->num_tables;
+    for (uint32_t i = 0; i < db->num_tables; i++)
+    {
+        Table* table = db->tables[i];
+        void* entry = catalog_entry(node, i);
+        strcpy(catalog_entry_name(entry), table->name);
+        *catalog_entry_root_page(entry) = table->root_page_num;
+        *catalog_entry_hash_directory(entry) = table->hash_directory_page_num;
+        *catalog_entry_bloom_filter(entry) = table->bloom_filter_page_num;
+        *catalog_entry_num_columns(entry) = table->schema.num_columns;
+        for (uint32_t j = 0; j < table->schema.num_columns; j++)
+        {
+            void* column = catalog_entry_column(entry, j);
+            strcpy(catalog_column_name(column), table->schema.columns[j].name);
+            *catalog_column_type(column) = table->schema.columns[j].type;
+            *catalog_column_width(column) = table->schema.columns[j].width;
+        }
+    }
+}
+
+// Writes every page of the current transaction, then publishes the new
+// catalog by writing the inactive header slot.
+void db_commit(Database* db)
+{
+    Pager* pager = db->pager;
+    bool has_dirty_pages = false;
+
+    for (uint32_t i = 0; i < pager->num_pages; i++)
+    {
+        if (pager->page_dirty[i])
+        {
+            has_dirty_pages = true;
+            break;
+        }
+    }
+    if (!has_dirty_pages)
+    {
+        return;
+    }
+
+    // Table roots move with every copy-on-write transaction, so the catalog
+    // page is rewritten along with them.
+    db->catalog_page_num = pager_shadow_page(pager, db->catalog_page_num);
+    catalog_write(db, get_page(pager, db->catalog_page_num));
+
+    // Filters are written in place, so each is stamped with the commit it
+    // belongs to and is on disk before that commit's header.
+    for (uint32_t i = 0; i < db->num_tables; i++)
+    {
+        uint32_t filter_page_num = db->tables[i]->bloom_filter_page_num;
+        if (pager->page_dirty[filter_page_num])
+        {
+            *bloom_filter_sequence(get_page(pager, filter_page_num)) = pager->commit_sequence + 1;
+        }
+    }
+
+    for (uint32_t i = 0; i < pager->num_pages; i++)
+    {
+        if (pager->page_dirty[i])
+        {
+            pager_flush(pager, i);
+            pager->page_dirty[i] = false;
+        }
+    }
+    pager_sync(pager);
+
+    uint32_t slot_num = (pager->active_header_slot + 1) % HEADER_NUM_SLOTS;
+    void* slot = header_slot(get_page(pager, HEADER_PAGE_NUM), slot_num);
+    header_slot_write(slot, pager->commit_sequence + 1, db->catalog_page_num);
+    pager_flush(pager, HEADER_PAGE_NUM);
+    pager_sync(pager);
+
+    pager->active_header_slot = slot_num;
+    pager->commit_sequence++;
+
+    // Pages retired by the previous commit were only reachable from the slot
+    // just overwritten.
+    for (uint32_t i = 0; i < pager->num_retired_pages; i++)
+    {
+        pager->free_pages[pager->num_free_pages++] = pager->retired_pages[i];
+    }
+    memcpy(pager->retired_pages, pager->shadowed_pages, pager->num_shadowed_pages * sizeof(uint32_t));
+    pager->num_retired_pages = pager->num_shadowed_pages;
+    pager->num_shadowed_pages = 0;
+}
+
+// New databases start with the original users table.
+const Schema DEFAULT_TABLE_SCHEMA = {
+    .num_columns = 3,
+    .columns = {
+        { .name = "id", .type = COLUMN_INTEGER, .width = sizeof(uint32_t) },
+        { .name = "username", .type = COLUMN_TEXT, .width = COLUMN_USERNAME_SIZE },
+        { .name = "email", .type = COLUMN_TEXT, .width = COLUMN_EMAIL_SIZE },
+    },
+};
+
+void pager_truncate(Pager* pager, uint32_t num_pages)
+{
+    if (ftruncate(pager->file_desc, (off_t)num_pages * PAGE_SIZE) == -1)
+    {
+        printf("Error: Fail to truncate file %d\n", errno);
         exit(EXIT_FAILURE);
     }
-    else if (child_num == num_keys)
+    pager->file_length = num_pages * PAGE_SIZE;
+    pager->num_pages = num_pages;
+}
+
+void db_initialize(Database* db)
+{
+    Pager* pager = db->pager;
+
+    // The first commit writes its pages before any header exists. A
+    // placeholder slot with no catalog marks the file as this engine's, so a
+    // crash before that commit finishes can be told apart from a foreign file.
+    void* header = get_page(pager, HEADER_PAGE_NUM);
+    memset(header, 0, PAGE_SIZE);
+    header_slot_write(header_slot(header, pager->active_header_slot), pager->commit_sequence, HEADER_PAGE_NUM);
+    pager_flush(pager, HEADER_PAGE_NUM);
+    pager_sync(pager);
+
+    db->catalog_page_num = get_unused_page_num(pager);
+    Schema schema = DEFAULT_TABLE_SCHEMA;
+    db_create_table(db, DEFAULT_TABLE_NAME, &schema);
+    db_commit(db);
+}
+
+bool page_is_node(void* page)
+{
+    return get_node_type(page) <= NODE_BLOOM_FILTER && *((uint8_t*)(page + IS_ROOT_OFFSET)) <= 1;
+}
+
+void print_prompt()
+{
+    printf("db > ");
+}
+
+void print_row(Schema* schema, void* row)
+{
+    printf("(");
+    for (uint32_t i = 0; i < schema->num_columns; i++)
     {
-        return internal_node_right_child(node);
+        Column* column = &schema->columns[i];
+        if (i > 0)
+        {
+            printf(", ");
+        }
+        switch (column->type)
+        {
+            case (COLUMN_INTEGER):
+                printf("%d", *((uint32_t*)(row + column->offset)));
+                break;
+
+            case (COLUMN_TEXT):
+                printf("%s", (char*)(row + column->offset));
+                break;
+        }
     }
-    else
+    printf(")\n");
+}
+
+void read_input(InputBuffer* input_buf)
+{
+    ssize_t bytes_read = getline(&(input_buf->buffer), &input_buf->buffer_length, stdin);
+    if (bytes_read <= 0)
     {
-        return internal_node_cell(node, child_num);
+        printf("Error: Reading input failed");
+        exit(EXIT_FAILURE);
+    }
+    input_buf->input_length = bytes_read - 1;
+    input_buf->buffer[bytes_read - 1] = 0;
+}
+
+void close_input_buffer(InputBuffer* input_buf)
+{
+    free(input_buf->buffer);
+    free(input_buf);
+}
+
+void indent(uint32_t level) 
+{
+    for (uint32_t i = 0; i < level; i++)    
+    {
+        printf("  ");
     }
 }
 
@@ -455,123 +1356,537 @@ void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
             child = *internal_node_right_child(node);
             print_tree(pager, child, indentation_level + 1);
             break;
+
+        default:
+            break;
     }
 }
 
-void print_constants()
+void print_constants(Table* table)
 {
-    printf("ROW_SIZE: %d\n", ROW_SIZE);
+    uint32_t cell_size = LEAF_NODE_KEY_SIZE + table->schema.row_size;
+    printf("ROW_SIZE: %d\n", table->schema.row_size);
     printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
     printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
-    printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
+    printf("LEAF_NODE_CELL_SIZE: %d\n", cell_size);
     printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
-    printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+    printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS / cell_size);
 }
 
-MetaCommandResult do_meta_command(InputBuffer* input_buf, Table *table)
+void print_schema(Table* table)
 {
-    if (strcmp(input_buf->buffer, ".exit") == 0)
-    {
-        db_close(table);
-        exit(EXIT_SUCCESS);
-    }
-    else if (strcmp(input_buf->buffer, ".btree") == 0)
-    {
-        printf("Tree:\n");
-        print_tree(table->pager, 0, 0);
-        return META_COMMAND_SUCCESS;
-    }
-    else if (strcmp(input_buf->buffer, ".constants") == 0)
-    {
-        printf("Constants: \n");
-        print_constants();
-        return META_COMMAND_SUCCESS;
-    }
-    else
+    printf("%s (", table->name);
+    for (uint32_t i = 0; i < table->schema.num_columns; i++)
     {
-        return META_COMMAND_FAIL;
+        Column* column = &table->schema.columns[i];
+        switch (column->type)
+        {
+            case (COLUMN_INTEGER):
+                printf("%s%s int", i > 0 ? ", " : "", column->name);
+                break;
+
+            case (COLUMN_TEXT):
+                printf("%s%s text(%d)", i > 0 ? ", " : "", column->name, column->width);
+                break;
+        }
     }
+    printf(")\n");
 }
 
-PrepareResult prepare_insert(InputBuffer* input_buf, Statement* statement)
+// Parses the values straight into the table's serialized row layout.
+PrepareResult prepare_insert(InputBuffer* input_buf, Statement* statement, Database* db)
 {
     statement->type = STATEMENT_INSERT;
 
     char* keyword = strtok(input_buf->buffer, " ");
-    char* id_string = strtok(NULL, " ");
-    char* username = strtok(NULL, " ");
-    char* email = strtok(NULL, " ");
+    char* token = strtok(NULL, " ");
+    char* table_name = DEFAULT_TABLE_NAME;
 
-    if (id_string == NULL || username == NULL || email == NULL)
+    if (token != NULL && strcmp(token, "into") == 0)
     {
-        return PREPARE_SYNTAX_ERROR;
+        table_name = strtok(NULL, " ");
+        token = strtok(NULL, " ");
+        if (table_name == NULL)
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
     }
 
-    int id = atoi(id_string);
-    if (id < 0)
+    Table* table = db_find_table(db, table_name);
+    if (table == NULL)
     {
-        return PREPARE_NEGATIVE_ID;
+        return PREPARE_UNKNOWN_TABLE;
     }
-    if (strlen(username) > COLUMN_USERNAME_SIZE || strlen(email) > COLUMN_EMAIL_SIZE)
+    Schema* schema = &table->schema;
+
+    void* row = arena_alloc(db->arena, schema->row_size);
+    memset(row, 0, schema->row_size);
+    for (uint32_t i = 0; i < schema->num_columns; i++, token = strtok(NULL, " "))
     {
-        return PREPARE_STRING_TOO_LONG;
-    }
+        if (token == NULL)
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+
+        Column* column = &schema->columns[i];
+        int value;
+        switch (column->type)
+        {
+            case (COLUMN_INTEGER):
+                value = atoi(token);
+                if (value < 0)
+                {
+                    return PREPARE_NEGATIVE_ID;
+                }
+                *((uint32_t*)(row + column->offset)) = value;
+                break;
 
-    statement->row_to_insert.id = id;
-    strcpy(statement->row_to_insert.username, username);
-    strcpy(statement->row_to_insert.email, email);
+            case (COLUMN_TEXT):
+                if (strlen(token) > column->width)
+                {
+                    return PREPARE_STRING_TOO_LONG;
+                }
+                memcpy(row + column->offset, token, strlen(token));
+                break;
+        }
+    }
 
+    statement->table = table;
+    statement->row_to_insert = row;
     return PREPARE_SUCCESS;
 }
 
-PrepareResult prepare_statement(InputBuffer* input_buf, Statement* statement)
+char* skip_spaces(char* text)
 {
-    if (strncmp(input_buf->buffer, "insert", 6) == 0)
-    {
-        return prepare_insert(input_buf, statement);
-    }
-    if (strcmp(input_buf->buffer, "select") == 0)
+    while (*text == ' ')
     {
-        statement->type = STATEMENT_SELECT;
-        return PREPARE_SUCCESS;
+        text++;
     }
-    return PREPARE_FAIL;
+    return text;
 }
 
-void serialize_row(Row* source, void* destination)
+// <column> = <value> | <column> < <n> | <column> > <n> | <column> like '<prefix>%'
+// Filters on the key column also narrow the key range of the scan.
+PrepareResult prepare_filter(char** rest, Statement* statement, Schema* schema)
 {
-    memcpy(destination + ID_OFFSET, &(source->id), ID_SIZE);
-    strncpy(destination + USERNAME_OFFSET, (source->username), USERNAME_SIZE);
-    strncpy(destination + EMAIL_OFFSET, (source->email), EMAIL_SIZE);
-}
+    char column_name[COLUMN_NAME_SIZE + 1];
+    char value[COLUMN_TEXT_MAX_SIZE + 4];
+    int consumed = 0;
+    *rest = skip_spaces(*rest);
+    if (sscanf(*rest, "%31[^=<> ]%n", column_name, &consumed) != 1 ||
+        statement->num_filters == SELECT_MAX_FILTERS)
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    char* operator = skip_spaces(*rest + consumed);
 
-void deserialize_row(void* source, Row* destination)
-{
-    memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
-    memcpy(&(destination->username), source + USERNAME_OFFSET, USERNAME_SIZE);
-    memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
-}
+    Filter* filter = &statement->filters[statement->num_filters++];
+    int32_t column_num = schema_find_column(schema, column_name);
+    if (column_num < 0)
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    filter->column_num = column_num;
+    Column* column = &schema->columns[column_num];
 
-void* cursor_value(Cursor* cursor)
-{
-    uint32_t page_num = cursor->page_num;
-    void* page = get_page(cursor->table->pager, page_num);
-    
-    return leaf_node_value(page, cursor->cell_num);
+    uint32_t operator_length = 1;
+    if (*operator == '=')
+    {
+        filter->type = FILTER_EQUAL;
+    }
+    else if (*operator == '<' && column->type == COLUMN_INTEGER)
+    {
+        filter->type = FILTER_LESS;
+    }
+    else if (*operator == '>' && column->type == COLUMN_INTEGER)
+    {
+        filter->type = FILTER_GREATER;
+    }
+    else if (strncmp(operator, "like ", 5) == 0 && column->type == COLUMN_TEXT)
+    {
+        filter->type = FILTER_PREFIX;
+        operator_length = 4;
+    }
+    else
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    consumed = 0;
+    if (sscanf(operator + operator_length, " %258[^ ]%n", value, &consumed) != 1)
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    *rest = skip_spaces(operator + operator_length + consumed);
+
+    if (column->type == COLUMN_INTEGER)
+    {
+        char* end;
+        long number = strtol(value, &end, 10);
+        if (*end != '\0' || end == value || number > UINT32_MAX)
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        if (number < 0)
+        {
+            return PREPARE_NEGATIVE_ID;
+        }
+        filter->value = number;
+
+        if (column_num == 0)
+        {
+            uint32_t key = number;
+            if (filter->type != FILTER_LESS && key >= statement->select_id)
+            {
+                statement->select_id = (filter->type == FILTER_GREATER) ? key + 1 : key;
+            }
+            if (filter->type != FILTER_GREATER && key <= statement->last_id)
+            {
+                statement->last_id = (filter->type == FILTER_LESS) ? key - 1 : key;
+            }
+            if ((filter->type == FILTER_GREATER && key == UINT32_MAX) || (filter->type == FILTER_LESS && key == 0))
+            {
+                // Nothing can match; leave an empty range.
+                statement->select_id = 1;
+                statement->last_id = 0;
+            }
+        }
+        return PREPARE_SUCCESS;
+    }
+
+    char* text = value;
+    uint32_t length = strlen(text);
+    if (length >= 2 && text[0] == '\'' && text[length - 1] == '\'')
+    {
+        text++;
+        length -= 2;
+    }
+    if (filter->type == FILTER_PREFIX)
+    {
+        // Only prefix patterns are supported.
+        if (length == 0 || text[length - 1] != '%' || memchr(text, '%', length - 1) || memchr(text, '_', length))
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        length--;
+    }
+    if (length > column->width)
+    {
+        return PREPARE_STRING_TOO_LONG;
+    }
+    memset(filter->text, 0, sizeof(filter->text));
+    memcpy(filter->text, text, length);
+    filter->text_length = length;
+    return PREPARE_SUCCESS;
 }
 
-Cursor* table_start(Table* table)
+// select [from <table>] [where <filter> [and <filter> ...]] [order by <column>]
+PrepareResult prepare_select(InputBuffer* input_buf, Statement* statement, Database* db)
 {
-    Cursor* cursor = malloc(sizeof(Cursor));
-    cursor->table = table;
-    cursor->page_num = table->root_page_num;
-    cursor->cell_num = 0;
+    statement->type = STATEMENT_SELECT;
+    statement->select_by_id = false;
+    statement->select_id = 0;
+    statement->last_id = UINT32_MAX;
+    statement->num_filters = 0;
+    statement->order_by_column = -1;
+
+    char* rest = input_buf->buffer + strlen("select");
+    char table_name[TABLE_NAME_SIZE + 1] = DEFAULT_TABLE_NAME;
+    int consumed = 0;
+    sscanf(rest, " from %31s%n", table_name, &consumed);
+    rest = skip_spaces(rest + consumed);
+
+    statement->table = db_find_table(db, table_name);
+    if (statement->table == NULL)
+    {
+        return PREPARE_UNKNOWN_TABLE;
+    }
+    Schema* schema = &statement->table->schema;
+    char column_name[COLUMN_NAME_SIZE + 1];
 
-    void* root_node = get_page(table->pager, table->root_page_num);
-    uint32_t num_cells = *leaf_node_num_cells(root_node);
-    cursor->end_of_table = (num_cells == 0);
+    if (strncmp(rest, "where ", 6) == 0)
+    {
+        rest += 6;
+        while (true)
+        {
+            PrepareResult result = prepare_filter(&rest, statement, schema);
+            if (result != PREPARE_SUCCESS)
+            {
+                return result;
+            }
+            if (strncmp(rest, "and ", 4) != 0)
+            {
+                break;
+            }
+            rest += 4;
+        }
 
-    return cursor;
+        // A lone key lookup goes to the point lookup path.
+        Filter* filter = &statement->filters[0];
+        if (statement->num_filters == 1 && filter->column_num == 0 && filter->type == FILTER_EQUAL)
+        {
+            statement->select_by_id = true;
+        }
+    }
+
+    if (strncmp(rest, "order", 5) == 0)
+    {
+        consumed = 0;
+        if (sscanf(rest, "order by %31s%n", column_name, &consumed) != 1)
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        statement->order_by_column = schema_find_column(schema, column_name);
+        if (statement->order_by_column < 0)
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        rest = skip_spaces(rest + consumed);
+    }
+
+    if (*rest != '\0')
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    return PREPARE_SUCCESS;
+}
+
+// create table <name> (<column> int | text(<width>), ...)
+// The first column must be an integer; it becomes the key.
+PrepareResult prepare_create_table(InputBuffer* input_buf, Statement* statement, Database* db)
+{
+    statement->type = STATEMENT_CREATE_TABLE;
+
+    strtok(input_buf->buffer, " ");
+    char* object = strtok(NULL, " ");
+    char* table_name = strtok(NULL, " (");
+    if (object == NULL || strcmp(object, "table") != 0 || table_name == NULL)
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    if (strlen(table_name) > TABLE_NAME_SIZE)
+    {
+        return PREPARE_STRING_TOO_LONG;
+    }
+    if (db_find_table(db, table_name) != NULL)
+    {
+        return PREPARE_TABLE_EXISTS;
+    }
+    if (db->num_tables == CATALOG_MAX_TABLES)
+    {
+        return PREPARE_CATALOG_FULL;
+    }
+
+    Schema* schema = &statement->schema;
+    schema->num_columns = 0;
+    char* column_name;
+    while ((column_name = strtok(NULL, " ,()")) != NULL)
+    {
+        char* type = strtok(NULL, " ,()");
+        if (type == NULL || schema->num_columns == TABLE_MAX_COLUMNS)
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        if (strlen(column_name) > COLUMN_NAME_SIZE)
+        {
+            return PREPARE_STRING_TOO_LONG;
+        }
+
+        Column* column = &schema->columns[schema->num_columns++];
+        strcpy(column->name, column_name);
+        if (strcmp(type, "int") == 0)
+        {
+            column->type = COLUMN_INTEGER;
+            column->width = sizeof(uint32_t);
+        }
+        else if (strcmp(type, "text") == 0)
+        {
+            char* width = strtok(NULL, " ,()");
+            if (width == NULL || atoi(width) <= 0)
+            {
+                return PREPARE_SYNTAX_ERROR;
+            }
+            if (atoi(width) > COLUMN_TEXT_MAX_SIZE)
+            {
+                return PREPARE_STRING_TOO_LONG;
+            }
+            column->type = COLUMN_TEXT;
+            column->width = atoi(width);
+        }
+        else
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+    }
+
+    if (schema->num_columns == 0 || schema->columns[0].type != COLUMN_INTEGER)
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    schema_compute_layout(schema);
+    if (LEAF_NODE_SPACE_FOR_CELLS / (LEAF_NODE_KEY_SIZE + schema->row_size) < LEAF_NODE_MIN_CELLS)
+    {
+        return PREPARE_ROW_TOO_LARGE;
+    }
+
+    strcpy(statement->table_name, table_name);
+    return PREPARE_SUCCESS;
+}
+
+// update [<table>] set <column> = <value>[, ...] where <key> = <n>
+// update [<table>] set <column> = <value>[, ...] where <key> between <n> and <m>
+PrepareResult prepare_update(InputBuffer* input_buf, Statement* statement, Database* db)
+{
+    statement->type = STATEMENT_UPDATE;
+    statement->num_assignments = 0;
+
+    char* rest = skip_spaces(input_buf->buffer + strlen("update"));
+    char table_name[TABLE_NAME_SIZE + 1] = DEFAULT_TABLE_NAME;
+    int consumed = 0;
+    if (strncmp(rest, "set ", 4) != 0)
+    {
+        sscanf(rest, "%31s%n", table_name, &consumed);
+        rest = skip_spaces(rest + consumed);
+    }
+
+    statement->table = db_find_table(db, table_name);
+    if (statement->table == NULL)
+    {
+        return PREPARE_UNKNOWN_TABLE;
+    }
+    if (strncmp(rest, "set ", 4) != 0)
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    rest += 4;
+
+    Schema* schema = &statement->table->schema;
+    statement->assigned_values = arena_alloc(db->arena, schema->row_size);
+    char column_name[COLUMN_NAME_SIZE + 1];
+    char value[COLUMN_TEXT_MAX_SIZE + 2];
+    while (true)
+    {
+        consumed = 0;
+        if (sscanf(rest, " %31[^= ] = %256[^, ]%n", column_name, value, &consumed) != 2 ||
+            statement->num_assignments == TABLE_MAX_COLUMNS)
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        rest = skip_spaces(rest + consumed);
+
+        int32_t column_num = schema_find_column(schema, column_name);
+        if (column_num < 0)
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        if (column_num == 0)
+        {
+            return PREPARE_KEY_UPDATE;
+        }
+
+        Column* column = &schema->columns[column_num];
+        void* destination = statement->assigned_values + column->offset;
+        switch (column->type)
+        {
+            case (COLUMN_INTEGER):
+                if (atoi(value) < 0)
+                {
+                    return PREPARE_NEGATIVE_ID;
+                }
+                *((uint32_t*)destination) = atoi(value);
+                break;
+
+            case (COLUMN_TEXT):
+                if (strlen(value) > column->width)
+                {
+                    return PREPARE_STRING_TOO_LONG;
+                }
+                // Pad with zeros so no trace of a longer old value is left.
+                memset(destination, 0, column->size);
+                memcpy(destination, value, strlen(value));
+                break;
+        }
+        statement->assigned_columns[statement->num_assignments++] = column_num;
+
+        if (*rest != ',')
+        {
+            break;
+        }
+        rest++;
+    }
+
+    int first_id, last_id;
+    consumed = 0;
+    if (sscanf(rest, "where %31[^= ] = %d%n", column_name, &first_id, &consumed) == 2)
+    {
+        last_id = first_id;
+    }
+    else
+    {
+        consumed = 0;
+        if (sscanf(rest, "where %31s between %d and %d%n", column_name, &first_id, &last_id, &consumed) != 3)
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+    }
+    if (schema_find_column(schema, column_name) != 0)
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    if (first_id < 0 || last_id < 0)
+    {
+        return PREPARE_NEGATIVE_ID;
+    }
+    statement->select_id = first_id;
+    statement->last_id = last_id;
+
+    if (*skip_spaces(rest + consumed) != '\0')
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    return PREPARE_SUCCESS;
+}
+
+PrepareResult prepare_statement(InputBuffer* input_buf, Statement* statement, Database* db)
+{
+    if (strncmp(input_buf->buffer, "insert", 6) == 0)
+    {
+        return prepare_insert(input_buf, statement, db);
+    }
+    if (strncmp(input_buf->buffer, "select", 6) == 0)
+    {
+        return prepare_select(input_buf, statement, db);
+    }
+    if (strncmp(input_buf->buffer, "create", 6) == 0)
+    {
+        return prepare_create_table(input_buf, statement, db);
+    }
+    if (strncmp(input_buf->buffer, "update", 6) == 0)
+    {
+        return prepare_update(input_buf, statement, db);
+    }
+    return PREPARE_FAIL;
+}
+
+// Rows are built in their serialized layout, so storing one is a single
+// copy of exactly the table's row size.
+void serialize_row(Schema* schema, void* source, void* destination)
+{
+    memcpy(destination, source, schema->row_size);
+}
+
+// The key column is always first, so every schema keeps it at offset 0.
+uint32_t row_key(void* row)
+{
+    return *((uint32_t*)row);
+}
+
+void* cursor_value(Cursor* cursor)
+{
+    uint32_t page_num = cursor->page_num;
+    void* page = get_page(cursor->table->pager, page_num);
+    
+    return leaf_node_value(page, cursor->cell_num);
 }
 
 Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key)
@@ -579,9 +1894,10 @@ Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key)
     void* node = get_page(table->pager, page_num);
     uint32_t num_cells = *leaf_node_num_cells(node);
 
-    Cursor* cursor = malloc(sizeof(Cursor));
+    Cursor* cursor = arena_alloc(table->arena, sizeof(Cursor));
     cursor->table = table;
     cursor->page_num = page_num;
+    cursor->end_of_table = false;
 
     uint32_t min_index = 0;
     uint32_t one_past_max_index = num_cells;
@@ -596,225 +1912,1738 @@ Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key)
         }
         if (key < key_at_index)
         {
-            one_past_max_index = index;
+            one_past_max_index = index;
+        }
+        else
+        {
+            min_index = index + 1;
+        }
+    }
+    cursor->cell_num = min_index;
+    return cursor;
+}
+
+uint32_t internal_node_find_child(void* node, uint32_t key)
+{
+    uint32_t num_keys = *internal_node_num_keys(node);
+
+    uint32_t min_index = 0;
+    uint32_t max_index = num_keys; // There is one more child than key
+    while (min_index != max_index)
+    {
+        uint32_t index = (min_index + max_index) / 2;
+        uint32_t key_to_right = *internal_node_key(node, index);
+        if (key_to_right >= key)
+        {
+            max_index = index;
+        }
+        else
+        {
+            min_index = index + 1;
+        }
+    }
+    return min_index;
+}
+
+Cursor* internal_node_find(Table* table, uint32_t page_num, uint32_t key)
+{
+    void* node = get_page(table->pager, page_num);
+    uint32_t child_index = internal_node_find_child(node, key);
+    uint32_t child_num = *internal_node_child(node, child_index);
+    void* child = get_page(table->pager, child_num);
+
+    switch (get_node_type(child))
+    {
+        case NODE_LEAF:
+            return leaf_node_find(table, child_num, key);
+        case NODE_INTERNAL:
+            return internal_node_find(table, child_num, key);
+        default:
+            break;
+    }
+    return NULL;
+}
+
+Cursor* table_find(Table* table, uint32_t key)
+{
+    uint32_t root_page_num = table->root_page_num;
+    void* root_node = get_page(table->pager, root_page_num);
+
+    if (get_node_type(root_node) == NODE_LEAF)
+    {
+        return leaf_node_find(table, root_page_num, key);
+    }
+    else
+    {
+        return internal_node_find(table, root_page_num, key);
+    }
+}
+
+Cursor* table_start(Table* table)
+{
+    Cursor* cursor = table_find(table, 0);
+
+    void* node = get_page(table->pager, cursor->page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    cursor->end_of_table = (num_cells == 0);
+
+    return cursor;
+}
+
+uint32_t table_height(Table* table)
+{
+    uint32_t height = 1;
+    void* node = get_page(table->pager, table->root_page_num);
+    while (get_node_type(node) == NODE_INTERNAL)
+    {
+        node = get_page(table->pager, *internal_node_child(node, 0));
+        height++;
+    }
+    return height;
+}
+
+// Counts the nodes under page_num whose keys can fall in the range, which
+// bounds the pages an update of the range shadows.
+uint32_t table_count_pages_in_range(Table* table, uint32_t page_num, uint32_t first_key, uint32_t last_key)
+{
+    void* node = get_page(table->pager, page_num);
+    if (get_node_type(node) != NODE_INTERNAL)
+    {
+        return 1;
+    }
+
+    uint32_t count = 1;
+    uint32_t num_keys = *internal_node_num_keys(node);
+    for (uint32_t i = 0; i <= num_keys; i++)
+    {
+        uint32_t lowest = (i == 0) ? 0 : *internal_node_key(node, i - 1) + 1;
+        uint32_t highest = (i == num_keys) ? UINT32_MAX : *internal_node_key(node, i);
+        if (lowest <= last_key && highest >= first_key)
+        {
+            count += table_count_pages_in_range(table, *internal_node_child(node, i), first_key, last_key);
+        }
+    }
+    return count;
+}
+
+// Copies every node on the path from the root to the leaf covering key into
+// pages owned by the current transaction, rewriting each parent's child
+// pointer on the way down. Returns the page number of the writable leaf.
+uint32_t table_shadow_path(Table* table, uint32_t key)
+{
+    Pager* pager = table->pager;
+    uint32_t old_page_num = table->root_page_num;
+    table->root_page_num = pager_shadow_page(pager, old_page_num);
+
+    uint32_t page_num = table->root_page_num;
+    void* node = get_page(pager, page_num);
+    while (get_node_type(node) == NODE_INTERNAL)
+    {
+        uint32_t* child_num = internal_node_child(node, internal_node_find_child(node, key));
+        old_page_num = *child_num;
+        *child_num = pager_shadow_page(pager, old_page_num);
+        page_num = *child_num;
+        node = get_page(pager, page_num);
+    }
+
+    if (table->rightmost_leaf_page_num == old_page_num)
+    {
+        table->rightmost_leaf_page_num = page_num;
+    }
+    return page_num;
+}
+
+uint32_t table_rightmost_leaf(Table* table)
+{
+    if (table->rightmost_leaf_page_num == 0)
+    {
+        uint32_t page_num = table->root_page_num;
+        void* node = get_page(table->pager, page_num);
+        while (get_node_type(node) == NODE_INTERNAL)
+        {
+            page_num = *internal_node_right_child(node);
+            node = get_page(table->pager, page_num);
+        }
+        table->rightmost_leaf_page_num = page_num;
+    }
+    return table->rightmost_leaf_page_num;
+}
+
+// Shadows the right edge of the tree by following right children only, so
+// appends never search a node.
+uint32_t table_shadow_right_spine(Table* table)
+{
+    Pager* pager = table->pager;
+    table->root_page_num = pager_shadow_page(pager, table->root_page_num);
+
+    uint32_t page_num = table->root_page_num;
+    void* node = get_page(pager, page_num);
+    while (get_node_type(node) == NODE_INTERNAL)
+    {
+        uint32_t* child_num = internal_node_right_child(node);
+        *child_num = pager_shadow_page(pager, *child_num);
+        page_num = *child_num;
+        node = get_page(pager, page_num);
+    }
+
+    table->rightmost_leaf_page_num = page_num;
+    return page_num;
+}
+
+// Nodes have no parent pointers, since copy-on-write would have to rewrite
+// every child of a shadowed node. The parent is found by descending again.
+uint32_t table_find_parent(Table* table, uint32_t child_page_num, uint32_t key)
+{
+    uint32_t page_num = table->root_page_num;
+    while (true)
+    {
+        void* node = get_page(table->pager, page_num);
+        uint32_t next_page_num = *internal_node_child(node, internal_node_find_child(node, key));
+        if (next_page_num == child_page_num)
+        {
+            return page_num;
+        }
+        page_num = next_page_num;
+    }
+}
+
+uint32_t get_node_max_key(void* node)
+{
+    switch (get_node_type(node))
+    {
+        case NODE_INTERNAL:
+            return *internal_node_key(node, *internal_node_num_keys(node) - 1);
+        case NODE_LEAF:
+            return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+        default:
+            break;
+    }
+    return 0;
+}
+
+void cursor_advance(Cursor* cursor)
+{
+    uint32_t page_num = cursor->page_num;
+    void* node = get_page(cursor->table->pager, page_num);
+    cursor->cell_num += 1;
+
+    if (cursor->cell_num >= (*leaf_node_num_cells(node)))
+    {
+        // Leaves have no sibling pointers, since copy-on-write would then
+        // have to rewrite the left neighbour of every shadowed leaf. Descend
+        // again for the smallest key past this leaf instead.
+        uint32_t max_key = get_node_max_key(node);
+        if (max_key == UINT32_MAX)
+        {
+            cursor->end_of_table = true;
+            return;
+        }
+
+        Cursor* next = table_find(cursor->table, max_key + 1);
+        void* next_node = get_page(cursor->table->pager, next->page_num);
+        if (next->page_num == page_num || next->cell_num >= *leaf_node_num_cells(next_node))
+        {
+            cursor->end_of_table = true;
+        }
+        else
+        {
+            cursor->page_num = next->page_num;
+            cursor->cell_num = next->cell_num;
+        }
+    }
+}
+
+void initialize_hash_directory(void* node)
+{
+    set_node_type(node, NODE_HASH_DIRECTORY);
+    set_node_root(node, false);
+    *hash_directory_global_depth(node) = 0;
+}
+
+void initialize_hash_bucket(void* node, uint32_t local_depth, uint32_t cell_size)
+{
+    set_node_type(node, NODE_HASH_BUCKET);
+    set_node_root(node, false);
+    *hash_bucket_local_depth(node) = local_depth;
+    *hash_bucket_num_cells(node) = 0;
+    *hash_bucket_cell_size(node) = cell_size;
+}
+
+// Returns the value stored for key, or NULL. Costs the directory page plus
+// one bucket page regardless of table size.
+void* hash_index_find(Table* table, uint32_t key)
+{
+    void* directory = get_page(table->pager, table->hash_directory_page_num);
+    uint32_t mask = (1u << *hash_directory_global_depth(directory)) - 1;
+    void* bucket = get_page(table->pager, *hash_directory_entry(directory, hash_key(key) & mask));
+
+    uint32_t num_cells = *hash_bucket_num_cells(bucket);
+    for (uint32_t i = 0; i < num_cells; i++)
+    {
+        void* cell = hash_bucket_cell(bucket, i);
+        if (*((uint32_t*)(cell + LEAF_NODE_KEY_OFFSET)) == key)
+        {
+            return cell + LEAF_NODE_VALUE_OFFSET;
+        }
+    }
+    return NULL;
+}
+
+// Several directory entries can share a bucket, so every one of them has to
+// follow the bucket to its shadow page.
+uint32_t hash_index_shadow_bucket(Pager* pager, void* directory, uint32_t entry_num)
+{
+    uint32_t old_page_num = *hash_directory_entry(directory, entry_num);
+    uint32_t new_page_num = pager_shadow_page(pager, old_page_num);
+    if (new_page_num != old_page_num)
+    {
+        uint32_t num_entries = 1u << *hash_directory_global_depth(directory);
+        for (uint32_t i = 0; i < num_entries; i++)
+        {
+            if (*hash_directory_entry(directory, i) == old_page_num)
+            {
+                *hash_directory_entry(directory, i) = new_page_num;
+            }
+        }
+    }
+    return new_page_num;
+}
+
+bool hash_index_split_bucket(Pager* pager, void* directory, uint32_t entry_num)
+{
+    uint32_t global_depth = *hash_directory_global_depth(directory);
+    uint32_t bucket_page_num = *hash_directory_entry(directory, entry_num);
+    void* bucket = get_page(pager, bucket_page_num);
+    uint32_t local_depth = *hash_bucket_local_depth(bucket);
+
+    if (local_depth == global_depth)
+    {
+        if (global_depth == HASH_DIRECTORY_MAX_GLOBAL_DEPTH)
+        {
+            return false;
+        }
+        // Double the directory. The new upper half mirrors the lower half.
+        uint32_t num_entries = 1u << global_depth;
+        for (uint32_t i = 0; i < num_entries; i++)
+        {
+            *hash_directory_entry(directory, num_entries + i) = *hash_directory_entry(directory, i);
+        }
+        global_depth += 1;
+        *hash_directory_global_depth(directory) = global_depth;
+    }
+
+    uint32_t new_page_num = get_unused_page_num(pager);
+    void* new_bucket = get_page(pager, new_page_num);
+    uint32_t cell_size = *hash_bucket_cell_size(bucket);
+    initialize_hash_bucket(new_bucket, local_depth + 1, cell_size);
+    *hash_bucket_local_depth(bucket) = local_depth + 1;
+
+    // Cells whose hash has the next bit set move to the new bucket.
+    uint32_t split_bit = 1u << local_depth;
+    uint32_t num_cells = *hash_bucket_num_cells(bucket);
+    uint32_t num_kept = 0;
+    for (uint32_t i = 0; i < num_cells; i++)
+    {
+        void* cell = hash_bucket_cell(bucket, i);
+        if (hash_key(*((uint32_t*)(cell + LEAF_NODE_KEY_OFFSET))) & split_bit)
+        {
+            uint32_t num_moved = (*hash_bucket_num_cells(new_bucket))++;
+            memcpy(hash_bucket_cell(new_bucket, num_moved), cell, cell_size);
+        }
+        else
+        {
+            if (num_kept != i)
+            {
+                memcpy(hash_bucket_cell(bucket, num_kept), cell, cell_size);
+            }
+            num_kept++;
+        }
+    }
+    *hash_bucket_num_cells(bucket) = num_kept;
+
+    uint32_t num_entries = 1u << global_depth;
+    for (uint32_t i = 0; i < num_entries; i++)
+    {
+        if (*hash_directory_entry(directory, i) == bucket_page_num && (i & split_bit))
+        {
+            *hash_directory_entry(directory, i) = new_page_num;
+        }
+    }
+    return true;
+}
+
+// Adds key to the hash index, splitting buckets as needed. Splits leave
+// reserved_pages unused for the rest of the statement. Returns false when
+// the directory is at its maximum depth or no page is left to split into.
+bool hash_index_insert(Table* table, uint32_t key, void* value, uint32_t reserved_pages)
+{
+    Pager* pager = table->pager;
+    table->hash_directory_page_num = pager_shadow_page(pager, table->hash_directory_page_num);
+    void* directory = get_page(pager, table->hash_directory_page_num);
+    uint32_t hash = hash_key(key);
+
+    while (true)
+    {
+        uint32_t mask = (1u << *hash_directory_global_depth(directory)) - 1;
+        uint32_t entry_num = hash & mask;
+        void* bucket = get_page(pager, hash_index_shadow_bucket(pager, directory, entry_num));
+
+        uint32_t num_cells = *hash_bucket_num_cells(bucket);
+        if (num_cells < hash_bucket_max_cells(bucket))
+        {
+            void* cell = hash_bucket_cell(bucket, num_cells);
+            *((uint32_t*)(cell + LEAF_NODE_KEY_OFFSET)) = key;
+            serialize_row(&table->schema, value, cell + LEAF_NODE_VALUE_OFFSET);
+            *hash_bucket_num_cells(bucket) += 1;
+            return true;
+        }
+        if (pager_num_unused_pages(pager) <= reserved_pages || !hash_index_split_bucket(pager, directory, entry_num))
+        {
+            return false;
+        }
+    }
+}
+
+uint32_t hash_index_num_buckets(Table* table)
+{
+    // A bucket of local depth d is shared by the entries that agree on the
+    // low d bits, so only the lowest of them is counted.
+    void* directory = get_page(table->pager, table->hash_directory_page_num);
+    uint32_t num_entries = 1u << *hash_directory_global_depth(directory);
+    uint32_t num_buckets = 0;
+    for (uint32_t i = 0; i < num_entries; i++)
+    {
+        void* bucket = get_page(table->pager, *hash_directory_entry(directory, i));
+        if (i < (1u << *hash_bucket_local_depth(bucket)))
+        {
+            num_buckets++;
+        }
+    }
+    return num_buckets;
+}
+
+// Returns the bucket's copy of key's row in a shadowed bucket, or NULL if the
+// key is not in the index.
+void* hash_index_find_writable(Table* table, uint32_t key)
+{
+    Pager* pager = table->pager;
+    table->hash_directory_page_num = pager_shadow_page(pager, table->hash_directory_page_num);
+    void* directory = get_page(pager, table->hash_directory_page_num);
+    uint32_t mask = (1u << *hash_directory_global_depth(directory)) - 1;
+    void* bucket = get_page(pager, hash_index_shadow_bucket(pager, directory, hash_key(key) & mask));
+
+    uint32_t num_cells = *hash_bucket_num_cells(bucket);
+    for (uint32_t i = 0; i < num_cells; i++)
+    {
+        void* cell = hash_bucket_cell(bucket, i);
+        if (*((uint32_t*)(cell + LEAF_NODE_KEY_OFFSET)) == key)
+        {
+            return cell + LEAF_NODE_VALUE_OFFSET;
+        }
+    }
+    return NULL;
+}
+
+// Builds the hash index from the rows already in the table. From then on
+// it is maintained by every insert.
+bool hash_index_create(Table* table)
+{
+    if (table->hash_directory_page_num != 0)
+    {
+        return true;
+    }
+
+    // The directory, the first bucket and the catalog's shadow.
+    Pager* pager = table->pager;
+    if (pager_num_unused_pages(pager) < 3)
+    {
+        return false;
+    }
+    table->hash_directory_page_num = get_unused_page_num(pager);
+    void* directory = get_page(pager, table->hash_directory_page_num);
+    initialize_hash_directory(directory);
+    uint32_t bucket_page_num = get_unused_page_num(pager);
+    initialize_hash_bucket(get_page(pager, bucket_page_num), 0, LEAF_NODE_KEY_SIZE + table->schema.row_size);
+    *hash_directory_entry(directory, 0) = bucket_page_num;
+
+    Cursor* cursor = table_start(table);
+    while (!(cursor->end_of_table))
+    {
+        void* row = cursor_value(cursor);
+        if (!hash_index_insert(table, row_key(row), row, 1))
+        {
+            table->hash_directory_page_num = 0;
+            return false;
+        }
+        cursor_advance(cursor);
+    }
+    return true;
+}
+
+void initialize_internal_node(void* node)
+{
+    set_node_type(node, NODE_INTERNAL);
+    set_node_root(node, false);
+    *internal_node_num_keys(node) = 0;
+}
+
+void create_new_root(Table* table, uint32_t right_child_page_num)
+{
+    void* root = get_page(table->pager, table->root_page_num);
+    void* right_child = get_page(table->pager, right_child_page_num);
+    uint32_t left_child_page_num = get_unused_page_num(table->pager);
+    void* left_child = get_page(table->pager, left_child_page_num);
+
+    memcpy(left_child, root, PAGE_SIZE);
+    set_node_root(left_child, false);
+
+    initialize_internal_node(root);
+    set_node_root(root, true);
+    *internal_node_num_keys(root) = 1;
+    *internal_node_child(root, 0) = left_child_page_num;
+
+    uint32_t left_child_max_key = get_node_max_key(left_child);
+    *internal_node_key(root, 0) = left_child_max_key;
+    *internal_node_right_child(root) = right_child_page_num;
+}
+
+void update_internal_node_key(void* node, uint32_t old_key, uint32_t new_key)
+{
+    uint32_t old_child_index = internal_node_find_child(node, old_key);
+    if (old_child_index < *internal_node_num_keys(node))
+    {
+        *internal_node_key(node, old_child_index) = new_key;
+    }
+}
+
+void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t child_page_num)
+{
+    void* parent = get_page(table->pager, parent_page_num);
+    void* child = get_page(table->pager, child_page_num);
+    uint32_t child_max_key = get_node_max_key(child);
+    uint32_t index = internal_node_find_child(parent, child_max_key);
+
+    uint32_t original_num_keys = *internal_node_num_keys(parent);
+    if (original_num_keys >= INTERNAL_NODE_MAX_CELLS)
+    {
+        printf("Need to implement splitting internal node\n");
+        exit(EXIT_FAILURE);
+    }
+    *internal_node_num_keys(parent) = original_num_keys + 1;
+
+    uint32_t right_child_page_num = *internal_node_right_child(parent);
+    void* right_child = get_page(table->pager, right_child_page_num);
+
+    if (child_max_key > get_node_max_key(right_child))
+    {
+        // The new child becomes the right child.
+        *internal_node_child(parent, original_num_keys) = right_child_page_num;
+        *internal_node_key(parent, original_num_keys) = get_node_max_key(right_child);
+        *internal_node_right_child(parent) = child_page_num;
+    }
+    else
+    {
+        for (uint32_t i = original_num_keys; i > index; i--)
+        {
+            memcpy(internal_node_cell(parent, i), internal_node_cell(parent, i - 1), INTERNAL_NODE_CELL_SIZE);
+        }
+        *internal_node_child(parent, index) = child_page_num;
+        *internal_node_key(parent, index) = child_max_key;
+    }
+}
+
+void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, void* value)
+{
+    void* old_node = get_page(cursor->table->pager, cursor->page_num);
+    uint32_t old_max_key = get_node_max_key(old_node);
+    uint32_t cell_size = *leaf_node_cell_size(old_node);
+    uint32_t max_cells = leaf_node_max_cells(old_node);
+    uint32_t right_split_count = (max_cells + 1) / 2;
+    uint32_t left_split_count = (max_cells + 1) - right_split_count;
+    if (cursor->cell_num == max_cells)
+    {
+        // Splitting at the right edge, as sequential inserts do. Keep the
+        // old leaf full and start the new one with only the new cell.
+        right_split_count = 1;
+        left_split_count = max_cells;
+    }
+
+    uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
+    void* new_node = get_page(cursor->table->pager, new_page_num);
+    initialize_leaf_node(new_node, cell_size);
+
+    for (int32_t i = max_cells; i >= 0; i--)
+    {
+        bool to_new_node = (uint32_t)i >= left_split_count;
+        void* destination_node;
+        if (to_new_node)
+        {
+            destination_node = new_node;
+        }
+        else
+        {
+            destination_node = old_node;
+        }
+        uint32_t index_within_node = to_new_node ? (uint32_t)i - left_split_count : (uint32_t)i;
+        void* destination = leaf_node_cell(destination_node, index_within_node);
+
+        if (i == cursor->cell_num)
+        {
+            *leaf_node_key(destination_node, index_within_node) = key;
+            serialize_row(&cursor->table->schema, value, leaf_node_value(destination_node, index_within_node));
+        }
+        else if (i > cursor->cell_num)
+        {
+            memcpy(destination, leaf_node_cell(old_node, i - 1), cell_size);
+        }
+        else
+        {
+            memcpy(destination, leaf_node_cell(old_node, i), cell_size);
+        }
+    }
+
+    *(leaf_node_num_cells(old_node)) = left_split_count;
+    *(leaf_node_num_cells(new_node)) = right_split_count;
+
+    Table* table = cursor->table;
+    if (table->rightmost_leaf_page_num == cursor->page_num)
+    {
+        table->rightmost_leaf_page_num = new_page_num;
+    }
+
+    if (is_node_root(old_node))
+    {
+        return create_new_root(table, new_page_num);
+    }
+    else
+    {
+        uint32_t parent_page_num = table_find_parent(table, cursor->page_num, key);
+        void* parent = get_page(table->pager, parent_page_num);
+        update_internal_node_key(parent, old_max_key, get_node_max_key(old_node));
+        internal_node_insert(table, parent_page_num, new_page_num);
+    }
+}
+
+void leaf_node_insert(Cursor* cursor, uint32_t key, void* value)
+{
+    void* node = get_page(cursor->table->pager, cursor->page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    
+    if (num_cells >= leaf_node_max_cells(node))
+    {
+        leaf_node_split_and_insert(cursor, key, value);
+        return;
+    }
+    if (cursor->cell_num < num_cells)
+    {
+        for (uint32_t i = num_cells; i > cursor->cell_num; i--)
+        {
+            memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i - 1), *leaf_node_cell_size(node));
+        }
+    }
+    *(leaf_node_num_cells(node)) += 1;
+    *(leaf_node_key(node, cursor->cell_num)) = key;
+    serialize_row(&cursor->table->schema, value, leaf_node_value(node, cursor->cell_num));
+}
+
+uint64_t sort_prefix(Column* column, void* row)
+{
+    if (column->type == COLUMN_INTEGER)
+    {
+        return *((uint32_t*)(row + column->offset));
+    }
+
+    // Text is zero padded past its terminator, so packing the first bytes
+    // big-endian orders prefixes the same way strcmp orders the strings.
+    uint8_t* text = row + column->offset;
+    uint64_t prefix = 0;
+    for (uint32_t i = 0; i < sizeof(uint64_t); i++)
+    {
+        prefix = (prefix << 8) | (i < column->size ? text[i] : 0);
+    }
+    return prefix;
+}
+
+int sort_compare_rows(Column* column, void* a, void* b)
+{
+    if (column->type == COLUMN_INTEGER)
+    {
+        uint32_t value_a = *((uint32_t*)(a + column->offset));
+        uint32_t value_b = *((uint32_t*)(b + column->offset));
+        return (value_a > value_b) - (value_a < value_b);
+    }
+    return strcmp(a + column->offset, b + column->offset);
+}
+
+int sort_compare_entries(const void* a, const void* b, void* column)
+{
+    return sort_compare_rows(column, ((SortEntry*)a)->row, ((SortEntry*)b)->row);
+}
+
+// Resizes the run buffers to hold allocated_rows rows. Returns false and
+// keeps the old buffers when memory runs out.
+bool sorter_resize(Sorter* sorter, uint32_t allocated_rows)
+{
+    uint32_t row_size = sorter->schema->row_size;
+    void* rows = realloc(sorter->rows, (size_t)allocated_rows * row_size);
+    if (rows == NULL)
+    {
+        return false;
+    }
+    sorter->rows = rows;
+    for (uint32_t i = 0; i < sorter->num_rows; i++)
+    {
+        sorter->entries[i].row = rows + (size_t)i * row_size;
+    }
+
+    SortEntry* entries = realloc(sorter->entries, (size_t)allocated_rows * sizeof(SortEntry));
+    if (entries == NULL)
+    {
+        return false;
+    }
+    sorter->entries = entries;
+    SortEntry* scratch = realloc(sorter->scratch, (size_t)allocated_rows * sizeof(SortEntry));
+    if (scratch == NULL)
+    {
+        return false;
+    }
+    sorter->scratch = scratch;
+    sorter->allocated_rows = allocated_rows;
+    return true;
+}
+
+// The run buffers start small and grow as rows arrive, up to what the budget
+// allows, so a short result never allocates the whole budget.
+Sorter* new_sorter(Schema* schema, uint32_t column_num, size_t memory_budget)
+{
+    Sorter* sorter = malloc(sizeof(Sorter));
+    if (sorter == NULL)
+    {
+        printf("Error: Not enough memory to sort.\n");
+        exit(EXIT_FAILURE);
+    }
+    sorter->schema = schema;
+    sorter->column = &schema->columns[column_num];
+    sorter->prefix_is_exact = sorter->column->type == COLUMN_INTEGER || sorter->column->size <= sizeof(uint64_t);
+
+    size_t run_capacity = memory_budget / (schema->row_size + 2 * sizeof(SortEntry));
+    if (run_capacity < 2)
+    {
+        run_capacity = 2;
+    }
+    if (run_capacity > SORT_MAX_RUN_ROWS)
+    {
+        run_capacity = SORT_MAX_RUN_ROWS;
+    }
+    sorter->run_capacity = run_capacity;
+
+    // Each open run costs a stdio buffer and a row while merging.
+    size_t fan_in = memory_budget / (BUFSIZ + schema->row_size);
+    if (fan_in < 2)
+    {
+        fan_in = 2;
+    }
+    if (fan_in > SORT_MAX_FAN_IN)
+    {
+        fan_in = SORT_MAX_FAN_IN;
+    }
+    sorter->fan_in = fan_in;
+
+    sorter->allocated_rows = 0;
+    sorter->rows = NULL;
+    sorter->entries = NULL;
+    sorter->scratch = NULL;
+    sorter->num_rows = 0;
+    sorter->runs = NULL;
+    sorter->run_levels = NULL;
+    sorter->num_runs = 0;
+    uint32_t initial_rows = SORT_INITIAL_RUN_ROWS < sorter->run_capacity ? SORT_INITIAL_RUN_ROWS : sorter->run_capacity;
+    if (!sorter_resize(sorter, initial_rows))
+    {
+        printf("Error: Not enough memory to sort.\n");
+        exit(EXIT_FAILURE);
+    }
+    return sorter;
+}
+
+// LSD radix sort on the prefixes, skipping bytes that every entry shares.
+// Only runs of equal prefixes are then compared in full.
+void sorter_sort_run(Sorter* sorter)
+{
+    SortEntry* source = sorter->entries;
+    SortEntry* destination = sorter->scratch;
+    uint32_t count = sorter->num_rows;
+    if (count == 0)
+    {
+        return;
+    }
+
+    for (uint32_t shift = 0; shift < 64; shift += 8)
+    {
+        uint32_t counts[256] = { 0 };
+        for (uint32_t i = 0; i < count; i++)
+        {
+            counts[(source[i].prefix >> shift) & 0xff]++;
+        }
+        if (counts[(source[0].prefix >> shift) & 0xff] == count)
+        {
+            continue;
+        }
+
+        uint32_t position = 0;
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t bucket_count = counts[i];
+            counts[i] = position;
+            position += bucket_count;
+        }
+        for (uint32_t i = 0; i < count; i++)
+        {
+            destination[counts[(source[i].prefix >> shift) & 0xff]++] = source[i];
+        }
+
+        SortEntry* swap = source;
+        source = destination;
+        destination = swap;
+    }
+    if (source != sorter->entries)
+    {
+        memcpy(sorter->entries, source, count * sizeof(SortEntry));
+    }
+
+    if (sorter->prefix_is_exact)
+    {
+        return;
+    }
+    uint32_t start = 0;
+    for (uint32_t i = 1; i <= count; i++)
+    {
+        if (i == count || sorter->entries[i].prefix != sorter->entries[start].prefix)
+        {
+            if (i - start > 1)
+            {
+                qsort_r(&sorter->entries[start], i - start, sizeof(SortEntry), sort_compare_entries, sorter->column);
+            }
+            start = i;
+        }
+    }
+}
+
+FILE* sorter_new_run_file()
+{
+    FILE* file = tmpfile();
+    if (file == NULL)
+    {
+        printf("Error: Unable to create sort run file %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    return file;
+}
+
+void sorter_push_run(Sorter* sorter, FILE* file, uint32_t level)
+{
+    FILE** runs = realloc(sorter->runs, (sorter->num_runs + 1) * sizeof(FILE*));
+    if (runs == NULL)
+    {
+        printf("Error: Not enough memory to sort.\n");
+        exit(EXIT_FAILURE);
+    }
+    sorter->runs = runs;
+    uint32_t* run_levels = realloc(sorter->run_levels, (sorter->num_runs + 1) * sizeof(uint32_t));
+    if (run_levels == NULL)
+    {
+        printf("Error: Not enough memory to sort.\n");
+        exit(EXIT_FAILURE);
+    }
+    sorter->run_levels = run_levels;
+    sorter->runs[sorter->num_runs] = file;
+    sorter->run_levels[sorter->num_runs] = level;
+    sorter->num_runs++;
+}
+
+bool sorter_read_row(Sorter* sorter, FILE* file, void* row)
+{
+    return fread(row, sorter->schema->row_size, 1, file) == 1;
+}
+
+// Merges runs with a binary min-heap over the current row of each run. The
+// merged rows go to output when it is set, otherwise to callback.
+void sorter_merge(Sorter* sorter, FILE** runs, uint32_t num_runs, FILE* output, RowCallback callback)
+{
+    uint32_t row_size = sorter->schema->row_size;
+    void* rows = malloc((size_t)num_runs * row_size);
+    uint32_t* heap = malloc(num_runs * sizeof(uint32_t));
+    if (rows == NULL || heap == NULL)
+    {
+        printf("Error: Not enough memory to sort.\n");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t heap_size = 0;
+
+    for (uint32_t i = 0; i < num_runs; i++)
+    {
+        if (!sorter_read_row(sorter, runs[i], rows + (size_t)i * row_size))
+        {
+            continue;
+        }
+        uint32_t child = heap_size++;
+        heap[child] = i;
+        while (child > 0)
+        {
+            uint32_t parent = (child - 1) / 2;
+            if (sort_compare_rows(sorter->column, rows + (size_t)heap[parent] * row_size,
+                                  rows + (size_t)heap[child] * row_size) <= 0)
+            {
+                break;
+            }
+            uint32_t swap = heap[parent];
+            heap[parent] = heap[child];
+            heap[child] = swap;
+            child = parent;
+        }
+    }
+
+    while (heap_size > 0)
+    {
+        uint32_t run = heap[0];
+        void* row = rows + (size_t)run * row_size;
+        if (output != NULL)
+        {
+            if (fwrite(row, row_size, 1, output) != 1)
+            {
+                printf("Error: Writing sort run %d\n", errno);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else
+        {
+            callback(sorter->schema, row);
+        }
+
+        if (!sorter_read_row(sorter, runs[run], row))
+        {
+            heap[0] = heap[--heap_size];
+        }
+
+        uint32_t parent = 0;
+        while (true)
+        {
+            uint32_t smallest = parent;
+            for (uint32_t child = 2 * parent + 1; child <= 2 * parent + 2 && child < heap_size; child++)
+            {
+                if (sort_compare_rows(sorter->column, rows + (size_t)heap[child] * row_size,
+                                      rows + (size_t)heap[smallest] * row_size) < 0)
+                {
+                    smallest = child;
+                }
+            }
+            if (smallest == parent)
+            {
+                break;
+            }
+            uint32_t swap = heap[parent];
+            heap[parent] = heap[smallest];
+            heap[smallest] = swap;
+            parent = smallest;
+        }
+    }
+
+    free(heap);
+    free(rows);
+}
+
+// Replaces the last count runs with one merged run at the given level.
+void sorter_merge_last_runs(Sorter* sorter, uint32_t count, uint32_t level)
+{
+    uint32_t first = sorter->num_runs - count;
+    FILE* output = sorter_new_run_file();
+    sorter_merge(sorter, sorter->runs + first, count, output, NULL);
+    rewind(output);
+    for (uint32_t i = first; i < sorter->num_runs; i++)
+    {
+        fclose(sorter->runs[i]);
+    }
+    sorter->num_runs = first;
+    sorter_push_run(sorter, output, level);
+}
+
+void sorter_spill_run(Sorter* sorter)
+{
+    sorter_sort_run(sorter);
+
+    FILE* file = sorter_new_run_file();
+    for (uint32_t i = 0; i < sorter->num_rows; i++)
+    {
+        if (fwrite(sorter->entries[i].row, sorter->schema->row_size, 1, file) != 1)
+        {
+            printf("Error: Writing sort run %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+    }
+    rewind(file);
+    sorter->num_rows = 0;
+    sorter_push_run(sorter, file, 0);
+
+    // Levels never increase along the runs, so the last fan_in runs share a
+    // level exactly when the first and last of them do.
+    while (sorter->num_runs >= sorter->fan_in &&
+           sorter->run_levels[sorter->num_runs - sorter->fan_in] == sorter->run_levels[sorter->num_runs - 1])
+    {
+        sorter_merge_last_runs(sorter, sorter->fan_in, sorter->run_levels[sorter->num_runs - 1] + 1);
+    }
+}
+
+void sorter_add(Sorter* sorter, void* row)
+{
+    if (sorter->num_rows == sorter->allocated_rows)
+    {
+        uint32_t allocated_rows = sorter->allocated_rows * 2;
+        if (allocated_rows > sorter->run_capacity)
+        {
+            allocated_rows = sorter->run_capacity;
+        }
+        if (allocated_rows == sorter->allocated_rows || !sorter_resize(sorter, allocated_rows))
+        {
+            // Out of budget or out of memory; either way the run is full.
+            sorter_spill_run(sorter);
+        }
+    }
+
+    void* copy = sorter->rows + (size_t)sorter->num_rows * sorter->schema->row_size;
+    memcpy(copy, row, sorter->schema->row_size);
+    sorter->entries[sorter->num_rows].prefix = sort_prefix(sorter->column, copy);
+    sorter->entries[sorter->num_rows].row = copy;
+    sorter->num_rows++;
+}
+
+// Emits every added row in order, then frees the sorter.
+void sorter_finish(Sorter* sorter, RowCallback callback)
+{
+    if (sorter->num_runs == 0)
+    {
+        sorter_sort_run(sorter);
+        for (uint32_t i = 0; i < sorter->num_rows; i++)
+        {
+            callback(sorter->schema, sorter->entries[i].row);
+        }
+    }
+    else
+    {
+        if (sorter->num_rows > 0)
+        {
+            sorter_spill_run(sorter);
+        }
+        while (sorter->num_runs > sorter->fan_in)
+        {
+            sorter_merge_last_runs(sorter, sorter->fan_in, sorter->run_levels[sorter->num_runs - 1] + 1);
+        }
+        sorter_merge(sorter, sorter->runs, sorter->num_runs, NULL, callback);
+    }
+
+    for (uint32_t i = 0; i < sorter->num_runs; i++)
+    {
+        fclose(sorter->runs[i]);
+    }
+    free(sorter->run_levels);
+    free(sorter->runs);
+    free(sorter->scratch);
+    free(sorter->entries);
+    free(sorter->rows);
+    free(sorter);
+}
+
+ExecuteResult execute_insert(Statement* statement, Table* table)
+{
+    void* row_to_insert = statement->row_to_insert;
+    uint32_t key_to_insert = row_key(row_to_insert);
+    Cursor* cursor;
+
+    void* filter = get_page(table->pager, table->bloom_filter_page_num);
+    bool maybe_duplicate = bloom_filter_might_contain(filter, key_to_insert);
+
+    // Every page the insert can take is checked for up front, so running out
+    // never leaves the statement half done: the path, a split that also
+    // splits the root, and the catalog's shadow at commit. Bucket splits in
+    // the hash index check for themselves.
+    uint32_t reserved_pages = table_height(table) + 2 + 1;
+    uint32_t pages_needed = reserved_pages + ((table->hash_directory_page_num != 0) ? 2 : 0);
+    if (pager_num_unused_pages(table->pager) < pages_needed)
+    {
+        return EXECUTE_TABLE_FULL;
+    }
+
+    void* rightmost_leaf = get_page(table->pager, table_rightmost_leaf(table));
+    uint32_t rightmost_num_cells = *leaf_node_num_cells(rightmost_leaf);
+
+    if (rightmost_num_cells > 0 && key_to_insert > *leaf_node_key(rightmost_leaf, rightmost_num_cells - 1))
+    {
+        // Past the largest key, so there is no duplicate to look for and the
+        // row goes at the end of the rightmost leaf.
+        if (table->hash_directory_page_num != 0 && !hash_index_insert(table, key_to_insert, row_to_insert, reserved_pages))
+        {
+            return EXECUTE_TABLE_FULL;
+        }
+        cursor = arena_alloc(table->arena, sizeof(Cursor));
+        cursor->table = table;
+        cursor->page_num = table_shadow_right_spine(table);
+        cursor->cell_num = rightmost_num_cells;
+        cursor->end_of_table = true;
+    }
+    else if (table->hash_directory_page_num != 0 || !maybe_duplicate)
+    {
+        // The filter or the hash index answers the duplicate check, so the
+        // tree is only descended once, on the way to the writable leaf.
+        if (maybe_duplicate && hash_index_find(table, key_to_insert) != NULL)
+        {
+            return EXECUTE_DUPLICATE_KEY;
+        }
+        if (table->hash_directory_page_num != 0 && !hash_index_insert(table, key_to_insert, row_to_insert, reserved_pages))
+        {
+            return EXECUTE_TABLE_FULL;
+        }
+        cursor = leaf_node_find(table, table_shadow_path(table, key_to_insert), key_to_insert);
+    }
+    else
+    {
+        cursor = table_find(table, key_to_insert);
+
+        void* node = get_page(table->pager, cursor->page_num);
+        uint32_t num_cells = (*leaf_node_num_cells(node));
+
+        if (cursor->cell_num < num_cells)
+        {
+            uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
+            if (key_at_index == key_to_insert)
+            {
+                return EXECUTE_DUPLICATE_KEY;
+            }
+        }
+
+        cursor->page_num = table_shadow_path(table, key_to_insert);
+    }
+
+    bloom_filter_add(filter, key_to_insert);
+    table->pager->page_dirty[table->bloom_filter_page_num] = true;
+    leaf_node_insert(cursor, key_to_insert, row_to_insert);
+
+    return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_select_by_id(Statement* statement, Table* table)
+{
+    uint32_t key = statement->select_id;
+    void* value = NULL;
+
+    if (!bloom_filter_might_contain(get_page(table->pager, table->bloom_filter_page_num), key))
+    {
+        return EXECUTE_SUCCESS;
+    }
+
+    if (table->hash_directory_page_num != 0)
+    {
+        value = hash_index_find(table, key);
+    }
+    else
+    {
+        Cursor* cursor = table_find(table, key);
+        void* node = get_page(table->pager, cursor->page_num);
+        if (cursor->cell_num < *leaf_node_num_cells(node) && *leaf_node_key(node, cursor->cell_num) == key)
+        {
+            value = leaf_node_value(node, cursor->cell_num);
+        }
+    }
+
+    if (value != NULL)
+    {
+        print_row(&table->schema, value);
+    }
+    return EXECUTE_SUCCESS;
+}
+
+void* batch_row(Batch* batch, uint32_t selected)
+{
+    return batch->cells + batch->selection[selected] * batch->cell_size + LEAF_NODE_VALUE_OFFSET;
+}
+
+// Each loop below is branch free: every row is written to the selection
+// vector, and the count only moves past it when the row passes.
+void batch_filter_integer(Batch* batch, Filter* filter, Column* column)
+{
+    uint32_t num_selected = batch->num_selected;
+    uint32_t offset = LEAF_NODE_VALUE_OFFSET + column->offset;
+    for (uint32_t i = 0; i < num_selected; i++)
+    {
+        batch->values[i] = *((uint32_t*)(batch->cells + batch->selection[i] * batch->cell_size + offset));
+    }
+
+    uint32_t value = filter->value;
+    uint32_t num_passed = 0;
+    switch (filter->type)
+    {
+        case (FILTER_EQUAL):
+            for (uint32_t i = 0; i < num_selected; i++)
+            {
+                batch->selection[num_passed] = batch->selection[i];
+                num_passed += (batch->values[i] == value);
+            }
+            break;
+
+        case (FILTER_LESS):
+            for (uint32_t i = 0; i < num_selected; i++)
+            {
+                batch->selection[num_passed] = batch->selection[i];
+                num_passed += (batch->values[i] < value);
+            }
+            break;
+
+        case (FILTER_GREATER):
+            for (uint32_t i = 0; i < num_selected; i++)
+            {
+                batch->selection[num_passed] = batch->selection[i];
+                num_passed += (batch->values[i] > value);
+            }
+            break;
+
+        default:
+            break;
+    }
+    batch->num_selected = num_passed;
+}
+
+void batch_filter_text(Batch* batch, Filter* filter, Column* column)
+{
+    // Equality also compares the terminator, so a longer value cannot match.
+    uint32_t length = filter->text_length + (filter->type == FILTER_EQUAL);
+    uint32_t num_passed = 0;
+    for (uint32_t i = 0; i < batch->num_selected; i++)
+    {
+        void* text = batch->cells + batch->selection[i] * batch->cell_size + LEAF_NODE_VALUE_OFFSET + column->offset;
+        batch->selection[num_passed] = batch->selection[i];
+        num_passed += (memcmp(text, filter->text, length) == 0);
+    }
+    batch->num_selected = num_passed;
+}
+
+// Loads the rest of the cursor's leaf into batch, keeps the rows passing
+// every filter and moves the cursor on to the next leaf. Returns false once
+// the scan is past the end of the table or of the statement's key range.
+bool table_scan_next(Cursor* cursor, Statement* statement, Batch* batch)
+{
+    Table* table = cursor->table;
+    if (cursor->end_of_table)
+    {
+        return false;
+    }
+    void* node = get_page(table->pager, cursor->page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    if (cursor->cell_num >= num_cells)
+    {
+        cursor->end_of_table = true;
+        return false;
+    }
+
+    batch->cells = leaf_node_cell(node, 0);
+    batch->cell_size = *leaf_node_cell_size(node);
+    batch->num_selected = 0;
+    for (uint32_t i = cursor->cell_num; i < num_cells; i++)
+    {
+        batch->selection[batch->num_selected++] = i;
+    }
+
+    for (uint32_t i = 0; i < statement->num_filters && batch->num_selected > 0; i++)
+    {
+        Filter* filter = &statement->filters[i];
+        Column* column = &table->schema.columns[filter->column_num];
+        if (column->type == COLUMN_INTEGER)
+        {
+            batch_filter_integer(batch, filter, column);
         }
         else
         {
-            min_index = index + 1;
+            batch_filter_text(batch, filter, column);
         }
     }
-    cursor->cell_num = min_index;
-    return cursor;
-}
 
-Cursor* table_find(Table* table, uint32_t key)
-{
-    uint32_t root_page_num = table->root_page_num;
-    void* root_node = get_page(table->pager, root_page_num);
-
-    if (get_node_type(root_node) == NODE_LEAF)
+    if (*leaf_node_key(node, num_cells - 1) >= statement->last_id)
     {
-        return leaf_node_find(table, root_page_num, key);
+        cursor->end_of_table = true;
     }
     else
     {
-        printf("Need to implement searching an internal node.");
-        exit(EXIT_FAILURE);
+        cursor->cell_num = num_cells - 1;
+        cursor_advance(cursor);
     }
+    return true;
 }
 
-void cursor_advance(Cursor* cursor)
+Cursor* table_scan_start(Table* table, Statement* statement)
 {
-    uint32_t page_num = cursor->page_num;
-    void* node = get_page(cursor->table->pager, page_num);
-    cursor->cell_num += 1;
-
-    if (cursor->cell_num >= (*leaf_node_num_cells(node)))
+    Cursor* cursor = table_find(table, statement->select_id);
+    if (statement->select_id > statement->last_id)
     {
         cursor->end_of_table = true;
     }
+    return cursor;
 }
 
-
-uint32_t get_node_max_key(void* node)
+// Rows are filtered a leaf at a time, and only the ones that pass are
+// printed.
+ExecuteResult execute_select(Statement* statement, Table* table)
 {
-    switch (get_node_type(node))
+    if (statement->select_by_id)
     {
-        case NODE_INTERNAL:
-            return *internal_node_key(node, *internal_node_num_keys(node) - 1);
-        case NODE_LEAF:
-            return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+        return execute_select_by_id(statement, table);
     }
-    return 0;
-}
 
-void initialize_internal_node(void* node)
-{
-    set_node_type(node, NODE_INTERNAL);
-    set_node_root(node, false);
-    *internal_node_num_keys(node) = 0;
+    Cursor* cursor = table_scan_start(table, statement);
+    Batch* batch = arena_alloc(table->arena, sizeof(Batch));
+
+    while (table_scan_next(cursor, statement, batch))
+    {
+        for (uint32_t i = 0; i < batch->num_selected; i++)
+        {
+            print_row(&table->schema, batch_row(batch, i));
+        }
+    }
+    return EXECUTE_SUCCESS;
 }
 
-void create_new_root(Table* table, uint32_t right_child_page_num)
+ExecuteResult execute_select_ordered(Statement* statement, Table* table, size_t memory_budget)
 {
-    void* root = get_page(table->pager, table->root_page_num);
-    void* right_child = get_page(table->pager, right_child_page_num);
-    uint32_t left_child_page_num = get_unused_page_num(table->pager);
-    void* left_child = get_page(table->pager, left_child_page_num);
-
-    memcpy(left_child, root, PAGE_SIZE);
-    set_node_type(left_child, false);
-
-    initialize_internal_node(root);
-    set_node_root(root, true);
-    *internal_node_num_keys(root) = 1;
-    *internal_node_child(root, 0) = left_child_page_num;
+    Sorter* sorter = new_sorter(&table->schema, statement->order_by_column, memory_budget);
+    Cursor* cursor = table_scan_start(table, statement);
+    Batch* batch = arena_alloc(table->arena, sizeof(Batch));
 
-    uint32_t left_child_max_key = get_node_max_key(left_child);
-    *internal_node_key(root, 0) = left_child_max_key;
-    *internal_node_right_child(root) = right_child_page_num;
+    while (table_scan_next(cursor, statement, batch))
+    {
+        for (uint32_t i = 0; i < batch->num_selected; i++)
+        {
+            sorter_add(sorter, batch_row(batch, i));
+        }
+    }
+    sorter_finish(sorter, print_row);
+    return EXECUTE_SUCCESS;
 }
 
-bool is_node_root(void* node)
+// Copies only the assigned columns; the rest of the row is left as it is.
+void update_row(Statement* statement, void* row)
 {
-    uint8_t value = *((uint8_t*)(node + IS_ROOT_OFFSET));
-    return (bool)value;
+    Schema* schema = &statement->table->schema;
+    for (uint32_t i = 0; i < statement->num_assignments; i++)
+    {
+        Column* column = &schema->columns[statement->assigned_columns[i]];
+        memcpy(row + column->offset, statement->assigned_values + column->offset, column->size);
+    }
 }
 
-void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value)
+// Rows are updated where they are, so the tree never changes shape. Each
+// leaf holding a matching row is shadowed once, on the first row it holds.
+ExecuteResult execute_update(Statement* statement, Table* table)
 {
-    void* old_node = get_page(cursor->table->pager, cursor->page_num);
-    uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
-    void* new_node = get_page(cursor->table->pager, new_page_num);
-    initialize_leaf_node(new_node);
+    Pager* pager = table->pager;
+    if (statement->select_id == statement->last_id &&
+        !bloom_filter_might_contain(get_page(pager, table->bloom_filter_page_num), statement->select_id))
+    {
+        return EXECUTE_SUCCESS;
+    }
 
-    for (int32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--)
+    // The shadowed tree nodes, every bucket and the directory, and the
+    // catalog's shadow at commit.
+    uint32_t pages_needed = table_count_pages_in_range(table, table->root_page_num, statement->select_id, statement->last_id) + 1;
+    if (table->hash_directory_page_num != 0)
     {
-        void* destination_node;
-        if (i >= LEAF_NODE_LEFT_SPLIT_COUNT)
+        pages_needed += 1 + hash_index_num_buckets(table);
+    }
+    if (pager_num_unused_pages(pager) < pages_needed)
+    {
+        return EXECUTE_TABLE_FULL;
+    }
+
+    Cursor* cursor = table_find(table, statement->select_id);
+    while (!(cursor->end_of_table))
+    {
+        void* node = get_page(pager, cursor->page_num);
+        if (cursor->cell_num >= *leaf_node_num_cells(node))
         {
-            destination_node = new_node;
+            break;
         }
-        else
+        uint32_t key = *leaf_node_key(node, cursor->cell_num);
+        if (key > statement->last_id)
         {
-            destination_node = old_node;
+            break;
         }
-        uint32_t index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
-        void* destination = leaf_node_cell(destination_node, index_within_node);
 
-        if (i == cursor->cell_num)
+        // A dirty leaf was made by this statement, so its path is shadowed.
+        if (!pager->page_dirty[cursor->page_num])
         {
-            serialize_row(value, destination);
+            cursor->page_num = table_shadow_path(table, key);
+            node = get_page(pager, cursor->page_num);
         }
-        else if (i > cursor->cell_num)
+        update_row(statement, leaf_node_value(node, cursor->cell_num));
+
+        if (table->hash_directory_page_num != 0)
         {
-            memcpy(destination, leaf_node_cell(old_node, i - 1), LEAF_NODE_CELL_SIZE);
+            update_row(statement, hash_index_find_writable(table, key));
         }
-        else
+        cursor_advance(cursor);
+    }
+    return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_create_table(Statement* statement, Database* db)
+{
+    // The root, the Bloom filter and the catalog's shadow.
+    if (pager_num_unused_pages(db->pager) < 3)
+    {
+        return EXECUTE_TABLE_FULL;
+    }
+    db_create_table(db, statement->table_name, &statement->schema);
+    return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_statement(Statement* statement, Database* db)
+{
+    switch (statement->type)
+    {
+        case (STATEMENT_INSERT):
+            return execute_insert(statement, statement->table);
+        
+        case (STATEMENT_SELECT):
+            if (statement->order_by_column >= 0 && !statement->select_by_id)
+            {
+                return execute_select_ordered(statement, statement->table, db->sort_memory_budget);
+            }
+            return execute_select(statement, statement->table);
+
+        case (STATEMENT_CREATE_TABLE):
+            return execute_create_table(statement, db);
+
+        case (STATEMENT_UPDATE):
+            return execute_update(statement, statement->table);
+    }
+    return EXECUTE_TABLE_FULL;
+}
+
+// Collects the rows of a pre-header leaf. Returns false if the page cannot
+// be such a leaf.
+bool pre_header_collect_leaf(Pager* pager, uint32_t page_num, void* rows, uint32_t row_size, uint32_t* num_rows, uint32_t* max_page_num)
+{
+    if (page_num >= pager->num_pages)
+    {
+        return false;
+    }
+    if (page_num > *max_page_num)
+    {
+        *max_page_num = page_num;
+    }
+
+    void* node = get_page(pager, page_num);
+    uint32_t cell_size = LEAF_NODE_KEY_SIZE + row_size;
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    if (num_cells > (PAGE_SIZE - PRE_HEADER_LEAF_NODE_HEADER_SIZE) / cell_size ||
+        *num_rows + num_cells > pager->num_pages * (PAGE_SIZE / cell_size))
+    {
+        return false;
+    }
+    for (uint32_t i = 0; i < num_cells; i++)
+    {
+        void* cell = node + PRE_HEADER_LEAF_NODE_HEADER_SIZE + i * cell_size;
+        void* row = cell + LEAF_NODE_VALUE_OFFSET;
+        if (*((uint32_t*)(cell + LEAF_NODE_KEY_OFFSET)) != row_key(row))
         {
-            memcpy(destination, leaf_node_cell(old_node, i), LEAF_NODE_CELL_SIZE);
+            // Older splits serialized the new row over the cell's key
+            // instead of after it.
+            row = cell;
         }
+        memcpy(rows + (*num_rows)++ * row_size, row, row_size);
     }
+    return true;
+}
 
-    *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-    *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
+// Pre-header trees are a root leaf, or a root internal node over leaves:
+// a second level of splits was never implemented. The children are read as
+// leaves whatever their type says, since the older create_new_root marked
+// the left child internal by mistake.
+bool pre_header_collect_rows(Pager* pager, void* rows, uint32_t row_size, uint32_t* num_rows, uint32_t* max_page_num)
+{
+    void* root = get_page(pager, HEADER_PAGE_NUM);
+    if (get_node_type(root) == NODE_LEAF)
+    {
+        return pre_header_collect_leaf(pager, HEADER_PAGE_NUM, rows, row_size, num_rows, max_page_num);
+    }
 
-    if (is_node_root(old_node))
+    uint32_t num_keys = *internal_node_num_keys(root);
+    if (num_keys >= pager->num_pages)
     {
-        return create_new_root(cursor->table, new_page_num);
+        return false;
     }
-    else
+    for (uint32_t i = 0; i <= num_keys; i++)
     {
-        printf("Need to implement updating parent after split\n");
-        exit(EXIT_FAILURE);
+        uint32_t child_page_num = *internal_node_child(root, i);
+        if (child_page_num == HEADER_PAGE_NUM ||
+            !pre_header_collect_leaf(pager, child_page_num, rows, row_size, num_rows, max_page_num))
+        {
+            return false;
+        }
     }
+    return true;
 }
 
-void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value)
+int compare_row_keys(const void* a, const void* b)
 {
-    void* node = get_page(cursor->table->pager, cursor->page_num);
-    uint32_t num_cells = *leaf_node_num_cells(node);
-    
-    if (num_cells >= LEAF_NODE_MAX_CELLS)
+    uint32_t key_a = row_key((void*)a);
+    uint32_t key_b = row_key((void*)b);
+    return (key_a > key_b) - (key_a < key_b);
+}
+
+// Converts a file from before the header page in one commit. The new tree
+// is built in pages after the old ones, and page 0 is only overwritten by
+// the header write at the end, so a crash leaves the old file to convert
+// again.
+void db_convert_pre_header_file(Database* db)
+{
+    Pager* pager = db->pager;
+    if (pager->file_length % PAGE_SIZE != 0)
     {
-        leaf_node_split_and_insert(cursor, key, value);
-        return;
+        printf("Error: Corrupt file. Db file is not a whole number of pages.\n");
+        exit(EXIT_FAILURE);
     }
-    if (cursor->cell_num < num_cells)
+
+    Schema schema = DEFAULT_TABLE_SCHEMA;
+    schema_compute_layout(&schema);
+    uint32_t row_size = schema.row_size;
+    void* rows = malloc((size_t)pager->num_pages * PAGE_SIZE);
+    uint32_t num_rows = 0;
+    uint32_t max_page_num = 0;
+    if (rows == NULL)
     {
-        for (uint32_t i = num_cells; i > cursor->cell_num; i--)
+        printf("Error: Unable to allocate memory to convert db file\n");
+        exit(EXIT_FAILURE);
+    }
+    if (!pre_header_collect_rows(pager, rows, row_size, &num_rows, &max_page_num))
+    {
+        printf("Error: Corrupt file. Db file has no valid header.\n");
+        exit(EXIT_FAILURE);
+    }
+    qsort(rows, num_rows, row_size, compare_row_keys);
+
+    // Pages past the old tree can only be left over from a conversion that
+    // crashed, so the new tree starts right after it.
+    uint32_t num_old_pages = max_page_num + 1;
+    pager->num_pages = num_old_pages;
+    memset(get_page(pager, HEADER_PAGE_NUM), 0, PAGE_SIZE);
+
+    db->catalog_page_num = get_unused_page_num(pager);
+    Table* table = db_create_table(db, DEFAULT_TABLE_NAME, &schema);
+    Statement statement;
+    statement.type = STATEMENT_INSERT;
+    statement.table = table;
+    for (uint32_t i = 0; i < num_rows; i++)
+    {
+        arena_reset(db->arena);
+        statement.row_to_insert = rows + i * row_size;
+        if (execute_insert(&statement, table) == EXECUTE_TABLE_FULL)
         {
-            memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i - 1), LEAF_NODE_CELL_SIZE);
+            printf("Error: Not enough pages to convert db file.\n");
+            exit(EXIT_FAILURE);
         }
     }
-    *(leaf_node_num_cells(node)) += 1;
-    *(leaf_node_key(node, cursor->cell_num)) = key;
-    serialize_row(value, leaf_node_value(node, cursor->cell_num));
+    free(rows);
+
+    // Extend the file before writing, so a crash part way leaves whole pages.
+    pager_truncate(pager, pager->num_pages);
+    db_commit(db);
+
+    for (uint32_t i = num_old_pages; i > HEADER_PAGE_NUM + 1; i--)
+    {
+        pager->free_pages[pager->num_free_pages++] = i - 1;
+    }
 }
 
-ExecuteResult execute_insert(Statement* statement, Table* table)
+Database* db_open(const char* filename, bool direct_io)
 {
-    void* node = get_page(table->pager, table->root_page_num);
-    uint32_t num_cells = (*leaf_node_num_cells(node));
+    Pager* pager = pager_open(filename, direct_io);
 
-    Row* row_to_insert = &(statement->row_to_insert);
-    uint32_t key_to_insert = row_to_insert->id;
-    Cursor* cursor = table_find(table, key_to_insert);
+    Database* db = malloc(sizeof(Database));
+    db->pager = pager;
+    db->num_tables = 0;
+    db->arena = new_arena(STATEMENT_ARENA_SIZE);
+    db->sort_memory_budget = SORT_MEMORY_BUDGET;
 
-    if (cursor->cell_num < num_cells)
+    if (pager->file_length == 0)
+    {
+        db_initialize(db);
+        return db;
+    }
+
+    void* header = get_page(pager, HEADER_PAGE_NUM);
+    bool found = false;
+    for (uint32_t i = 0; i < HEADER_NUM_SLOTS; i++)
     {
-        uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
-        if (key_at_index == key_to_insert)
+        void* slot = header_slot(header, i);
+        if (header_slot_is_valid(slot) && (!found || *header_slot_sequence(slot) > pager->commit_sequence))
         {
-            return EXECUTE_DUPLICATE_KEY;
+            found = true;
+            pager->active_header_slot = i;
+            pager->commit_sequence = *header_slot_sequence(slot);
+            db->catalog_page_num = *header_slot_catalog_page(slot);
+        }
+    }
+    // Nothing is written to the file until a header slot shows it is a
+    // database.
+    if (!found && get_node_type(header) <= NODE_LEAF && is_node_root(header))
+    {
+        db_convert_pre_header_file(db);
+        return db;
+    }
+    if (!found)
+    {
+        printf("Error: Corrupt file. Db file has no valid header.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (db->catalog_page_num == HEADER_PAGE_NUM)
+    {
+        // Only the placeholder slot: the first commit never finished, so
+        // nothing was ever committed. Start over if the pages it got to
+        // write look like this engine's.
+        for (uint32_t i = HEADER_PAGE_NUM + 1; i < pager->num_pages; i++)
+        {
+            if (!page_is_node(get_page(pager, i)))
+            {
+                printf("Error: Corrupt file. Db file has no valid header.\n");
+                exit(EXIT_FAILURE);
+            }
         }
+        for (uint32_t i = 0; i < pager->num_pages; i++)
+        {
+            pager->pages[i] = NULL;
+        }
+        pager_truncate(pager, 0);
+        db_initialize(db);
+        return db;
     }
 
-    leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
+    // A partial page at the end can only be a torn append from a transaction
+    // that never reached the header.
+    if (pager->file_length % PAGE_SIZE != 0)
+    {
+        pager_truncate(pager, pager->num_pages);
+    }
 
-    free(cursor);
-    
-    return EXECUTE_SUCCESS;
+    catalog_read(db, get_page(pager, db->catalog_page_num));
+    pager_reclaim_unreachable_pages(pager);
+    return db;
 }
 
-ExecuteResult execute_select(Statement* statement, Table* table)
+void db_close(Database* db)
 {
-    Cursor* cursor = table_start(table);
-    Row row;
+    Pager* pager = db->pager;
 
-    while (!(cursor->end_of_table))
+    db_commit(db);
+
+    int result = close(pager->file_desc);
+    if (result == -1)
     {
-        deserialize_row(cursor_value(cursor), &row);
-        print_row(&row);
-        cursor_advance(cursor);
+        printf("Error: Fail to close db file.\n");
+        exit(EXIT_FAILURE);
     }
-    free(cursor);
-    return EXECUTE_SUCCESS;
+    munmap(pager->frames, pager->frames_size);
+    free(pager);
+    for (uint32_t i = 0; i < db->num_tables; i++)
+    {
+        free(db->tables[i]);
+    }
+    free_arena(db->arena);
+    free(db);
 }
 
-ExecuteResult execute_statement(Statement* statement, Table* table)
+// Meta commands that act on one table take its name as an optional
+// argument and default to the users table.
+Table* meta_command_table(Database* db, const char* argument)
 {
-    switch (statement->type)
+    if (*argument == '\0')
     {
-        case (STATEMENT_INSERT):
-            return execute_insert(statement, table);
-        
-        case (STATEMENT_SELECT):
-            return execute_select(statement, table);
+        return db_find_table(db, DEFAULT_TABLE_NAME);
+    }
+    if (*argument != ' ')
+    {
+        return NULL;
+    }
+    return db_find_table(db, argument + 1);
+}
+
+MetaCommandResult do_meta_command(InputBuffer* input_buf, Database* db)
+{
+    Table* table;
+    if (strcmp(input_buf->buffer, ".exit") == 0)
+    {
+        db_close(db);
+        exit(EXIT_SUCCESS);
+    }
+    else if (strncmp(input_buf->buffer, ".btree", 6) == 0 &&
+             (table = meta_command_table(db, input_buf->buffer + 6)) != NULL)
+    {
+        printf("Tree:\n");
+        print_tree(table->pager, table->root_page_num, 0);
+        return META_COMMAND_SUCCESS;
+    }
+    else if (strncmp(input_buf->buffer, ".hashindex", 10) == 0 &&
+             (table = meta_command_table(db, input_buf->buffer + 10)) != NULL)
+    {
+        if (!hash_index_create(table))
+        {
+            printf("Error: Hash index is full.\n");
+        }
+        db_commit(db);
+        return META_COMMAND_SUCCESS;
+    }
+    else if (strncmp(input_buf->buffer, ".constants", 10) == 0 &&
+             (table = meta_command_table(db, input_buf->buffer + 10)) != NULL)
+    {
+        printf("Constants: \n");
+        print_constants(table);
+        return META_COMMAND_SUCCESS;
+    }
+    else if (strncmp(input_buf->buffer, ".sortbudget ", 12) == 0)
+    {
+        // Reject negative and out-of-range budgets rather than let them wrap.
+        char* argument = input_buf->buffer + 12;
+        char* end;
+        errno = 0;
+        unsigned long long budget = strtoull(argument, &end, 10);
+        if (*argument < '0' || *argument > '9' || *end != '\0' || errno == ERANGE || budget > SIZE_MAX)
+        {
+            return META_COMMAND_FAIL;
+        }
+        db->sort_memory_budget = budget;
+        return META_COMMAND_SUCCESS;
+    }
+    else if (strcmp(input_buf->buffer, ".tables") == 0)
+    {
+        for (uint32_t i = 0; i < db->num_tables; i++)
+        {
+            print_schema(db->tables[i]);
+        }
+        return META_COMMAND_SUCCESS;
+    }
+    else
+    {
+        return META_COMMAND_FAIL;
     }
-    return EXECUTE_TABLE_FULL;
 }
 
 int main(int argc, char* argv[])
 {
     if (argc < 2)
     {
-        printf("./d <database filename>\n");
+        printf("./d <database filename> [--direct]\n");
         exit(EXIT_FAILURE);
     }
 
     char* filename = argv[1];
-    Table* table = db_open(filename);
+    bool direct_io = (argc > 2 && strcmp(argv[2], "--direct") == 0);
+    Database* db = db_open(filename, direct_io);
 
     InputBuffer* input_buf = new_input_buffer();
 
@@ -825,7 +3654,7 @@ int main(int argc, char* argv[])
 
         if (input_buf->buffer[0] == '.')
         {
-            switch (do_meta_command(input_buf, table))
+            switch (do_meta_command(input_buf, db))
             {
                 case (META_COMMAND_SUCCESS):
                     continue;
@@ -836,8 +3665,10 @@ int main(int argc, char* argv[])
             }
         }
 
-        Statement statement;
-        switch (prepare_statement(input_buf, &statement))
+        // Everything allocated for the previous statement is dead by now.
+        arena_reset(db->arena);
+        Statement* statement = arena_alloc(db->arena, sizeof(Statement));
+        switch (prepare_statement(input_buf, statement, db))
         {
             case (PREPARE_SUCCESS):
                 break;
@@ -853,12 +3684,35 @@ int main(int argc, char* argv[])
                 printf("Error: Syntax error\n");
                 continue;
 
+            case (PREPARE_UNKNOWN_TABLE):
+                printf("Error: No such table.\n");
+                continue;
+
+            case (PREPARE_TABLE_EXISTS):
+                printf("Error: Table already exists.\n");
+                continue;
+
+            case (PREPARE_CATALOG_FULL):
+                printf("Error: Catalog is full.\n");
+                continue;
+
+            case (PREPARE_ROW_TOO_LARGE):
+                printf("Error: Row is too large.\n");
+                continue;
+
+            case (PREPARE_KEY_UPDATE):
+                printf("Error: The key column cannot be updated.\n");
+                continue;
+
             case (PREPARE_FAIL):
                 printf("Error: Unrecognized keyword at start of '%s'.\n", input_buf->buffer);
                 continue;
         }
 
-        switch (execute_statement(&statement, table))
+        // The result is only reported once it is durable.
+        ExecuteResult result = execute_statement(statement, db);
+        db_commit(db);
+        switch (result)
         {
             case (EXECUTE_SUCCESS):
                 printf("Executed.\n");